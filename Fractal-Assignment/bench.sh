@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Benchmark suite, run by "make bench".  Renders a fixed set of views at
+# several sizes and thread counts and prints one JSON document holding
+# the statistics of every render (see mandel -J), each with its scaling
+# efficiency against the first thread count of the same view and size:
+# 1 means the extra threads sped it up in proportion.
+#
+# BENCH_SIZES and BENCH_THREADS override the sizes and thread counts,
+# e.g. make bench BENCH_THREADS="1 2 4 8 16".
+
+sizes=${BENCH_SIZES:-"500 1000 2000"}
+threads=${BENCH_THREADS:-"1 2 4 8"}
+mandel=${MANDEL:-./mandel}
+
+# name|options; the last three are the examples in mandel -h
+views='full|-x -0.75 -y 0 -s 1.5 -m 1000
+seahorse|-x -0.7463 -y 0.1102 -s 0.005 -m 2000
+minibrot|-x -1.99996986460878667471036183309574861816515319890 -y 0 -s 2e-14 -m 3000
+example1|-x -0.5 -y -0.5 -s 0.2
+example2|-x -.38 -y -.665 -s .05 -m 100
+example3|-x 0.286932 -y 0.014287 -s .0005 -m 1000'
+
+stats=$(mktemp) || exit 1
+trap 'rm -f "$stats"' EXIT
+
+field() {
+	sed -n "s/.*\"$1\":\([0-9.e+-]*\).*/\1/p" "$stats"
+}
+
+printf '{"cpus":%s,"runs":[\n' "$(getconf _NPROCESSORS_ONLN)"
+sep=""
+
+echo "$views" | while IFS='|' read -r name options; do
+	for size in $sizes; do
+		base=""
+		for t in $threads; do
+			# $options is split into words on purpose
+			if ! $mandel $options -W "$size" -H "$size" -t "$t" -J "$stats" -o /dev/null >/dev/null; then
+				echo "bench: $name ${size}x$size with $t threads failed" >&2
+				exit 1
+			fi
+
+			seconds=$(field compute_seconds)
+			if [ -z "$base" ]; then
+				base="$seconds $t"
+			fi
+			efficiency=$(echo "$base $seconds $t" | awk '{ printf "%.4f", $1*$2/($3*$4) }')
+
+			echo "bench: $name ${size}x$size threads=$t $(field mpixels_per_sec) Mpixels/s imbalance=$(field imbalance) efficiency=$efficiency" >&2
+			printf '%s{"view":"%s","efficiency":%s,%s\n' "$sep" "$name" "$efficiency" "$(sed 's/^{//' "$stats")"
+			sep=","
+		done
+	done
+done || exit 1
+
+printf ']}\n'
@@ -1,199 +1,571 @@
-
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-
-#include "bitmap.h"
-
-struct bitmap {
-	int width;
-	int height;
-	int *data;
-};
-
-struct bitmap * bitmap_create( int w, int h )
-{
-	struct bitmap *m;
-
-	m = malloc(sizeof *m);
-	if(!m) return 0;
-
-	m->data = malloc(w*h*sizeof(int));
-	if(!m->data) {
-		free(m);
-		return 0;
-	}
-
-	m->width = w;
-	m->height = h;
-
-	return m;
-}
-
-void bitmap_delete( struct bitmap *m )
-{
-	free(m->data);
-	free(m);
-}
-
-void bitmap_reset( struct bitmap *m, int value )
-{
-	int i;
-	for(i=0;i<(m->width*m->height);i++) {
-		m->data[i] = value;
-	}
-}
-
-int bitmap_get( struct bitmap *m, int x, int y )
-{
-	while(x>=m->width)  x-=m->width;
-	while(y>=m->height) y-=m->height;
-	while(x<0)         x+=m->width;
-	while(y<0)         y+=m->height;
-
-	return m->data[y*m->width+x];
-}
-
-void bitmap_set( struct bitmap *m, int x, int y, int value )
-{
-	while(x>=m->width)  x-=m->width;
-	while(y>=m->height) y-=m->height;
-	while(x<0)         x+=m->width;
-	while(y<0)         y+=m->height;
-
-	m->data[y*m->width+x] = value;
-}
-
-int bitmap_width( struct bitmap *m )
-{
-	return m->width;
-}
-
-int bitmap_height( struct bitmap *m )
-{
-	return m->height;
-}
-
-int * bitmap_data( struct bitmap *m )
-{
-	return m->data;
-}
-
-#pragma pack(1)
-struct bmp_header {
-	char	magic1;
-	char	magic2;
-	int	size;
-	int	reserved;
-	int	offset;
-	int	infosize;
-	int	width;
-	int	height;
-	short	planes;
-	short	bits;
-	int	compression;
-	int	imagesize;
-	int	xres;
-	int	yres;
-	int	ncolors;
-	int	icolors;
-};
-
-int bitmap_save( struct bitmap *m, const char *path )
-{
-	FILE *file;
-	struct bmp_header header;
-	int i, j;
-	unsigned char *scanline, *s;
-
-	file = fopen(path,"wb");
-	if(!file) return 0;
-
-	memset(&header,0,sizeof(header));
-	header.magic1 = 'B';
-	header.magic2 = 'M';
-	header.size   = m->width*m->height*3;
-	header.offset = sizeof(header);
-	header.infosize = sizeof(header)-14;
-	header.width = m->width;
-	header.height = m->height;
-	header.planes = 1;
-	header.bits = 24;
-	header.compression = 0;
-	header.imagesize = m->width*m->height*3;
-	header.xres = 1000;
-	header.yres = 1000;
-
-	fwrite(&header,1,sizeof(header),file);
-
-	/* if the scanline is not a multiple of four, round it up. */
-	int padlength = 4 - (m->width*3)%4;
-	if(padlength==4) padlength=0;
-
-	scanline = malloc(header.width*3);
-
-	for(j=0;j<m->height;j++) {
-		s = scanline;
-		for(i=0;i<m->width;i++) {
-			int rgba = bitmap_get(m,i,j);
-			*s++ = GET_BLUE(rgba);
-			*s++ = GET_GREEN(rgba);
-			*s++ = GET_RED(rgba);
-		}
-		fwrite(scanline,1,m->width*3,file);
-		fwrite(scanline,1,padlength,file);
-	}
-
-	free(scanline);
-
-	fclose(file);
-	return 1;
-}
-
-struct bitmap * bitmap( const char *path )
-{
-	FILE *file;
-	int size;
-	struct bitmap *m;
-	struct bmp_header header;
-	int i;
-
-	file = fopen(path,"rb");
-	if(!file) return 0;
-
-	fread(&header,1,sizeof(header),file);
-
-	if(header.magic1!='B' || header.magic2!='M') {
-		printf("bitmap: %s is not a BMP file.\n",path);
-		fclose(file);
-		return 0;
-	}
-
-	if(header.compression!=0 || header.bits!=24) {
-		printf("bitmap: sorry, I only support 24-bit uncompressed bitmaps.\n");
-		fclose(file);
-		return 0;
-	}
-
-	m = bitmap_create(header.width,header.height);
-	if(!m) {
-		fclose(file);
-		return 0;
-	}
-
-	size = header.width*header.height;
-	for(i=0;i<size;i++) {
-		int r,g,b;
-		b = fgetc(file);
-		g = fgetc(file);
-		r = fgetc(file);
-		if(b==0 && g==0 && r==0) {
-			m->data[i] = 0;
-		} else {
-			m->data[i] = MAKE_RGBA(r,g,b,255);
-		}	
-	}
-
-	fclose(file);
-	return m;
-}
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bitmap.h"
+#include "png.h"
+
+struct bitmap * bitmap_create( int w, int h )
+{
+	struct bitmap *m;
+
+	/* the size is computed in size_t, gigapixel images overflow int */
+	if(w<1 || h<1 || (size_t)w > SIZE_MAX/sizeof(int)/(size_t)h) return 0;
+
+	m = malloc(sizeof *m);
+	if(!m) return 0;
+
+	m->data = malloc((size_t)w*h*sizeof(int));
+	if(!m->data) {
+		free(m);
+		return 0;
+	}
+
+	m->width = w;
+	m->height = h;
+
+	return m;
+}
+
+void bitmap_delete( struct bitmap *m )
+{
+	free(m->data);
+	free(m);
+}
+
+void bitmap_reset( struct bitmap *m, int value )
+{
+	size_t i;
+	for(i=0;i<(size_t)m->width*m->height;i++) {
+		m->data[i] = value;
+	}
+}
+
+/* Wrap v around into 0 ... n-1, cheaply when it is already there. */
+static int wrap( int v, int n )
+{
+	if((unsigned)v < (unsigned)n) return v;
+	v %= n;
+	return v<0 ? v+n : v;
+}
+
+int bitmap_get( struct bitmap *m, int x, int y )
+{
+	return bitmap_get_fast(m,wrap(x,m->width),wrap(y,m->height));
+}
+
+void bitmap_set( struct bitmap *m, int x, int y, int value )
+{
+	bitmap_set_fast(m,wrap(x,m->width),wrap(y,m->height),value);
+}
+
+int bitmap_width( struct bitmap *m )
+{
+	return m->width;
+}
+
+int bitmap_height( struct bitmap *m )
+{
+	return m->height;
+}
+
+int * bitmap_data( struct bitmap *m )
+{
+	return m->data;
+}
+
+#pragma pack(1)
+struct bmp_header {
+	char	magic1;
+	char	magic2;
+	int	size;
+	int	reserved;
+	int	offset;
+	int	infosize;
+	int	width;
+	int	height;
+	short	planes;
+	short	bits;
+	int	compression;
+	int	imagesize;
+	int	xres;
+	int	yres;
+	int	ncolors;
+	int	icolors;
+};
+
+/*
+Saving converts whole rows from RGBA to the BGR of the file into one
+large buffer and writes it out once it holds SAVE_BUFFER bytes or so,
+instead of converting and writing pixel by pixel.
+*/
+
+#define SAVE_BUFFER (4<<20)
+
+/* Convert n RGBA pixels to BGR. */
+static void rgba_to_bgr_scalar( const int *src, unsigned char *dst, int n )
+{
+	int i;
+	for(i=0;i<n;i++) {
+		int rgba = src[i];
+		*dst++ = GET_BLUE(rgba);
+		*dst++ = GET_GREEN(rgba);
+		*dst++ = GET_RED(rgba);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+In memory an RGBA pixel is the bytes B G R A, so one byte shuffle drops
+the A of four pixels at once.  Each step stores 16 bytes but only
+advances 12, so dst needs 4 bytes to spare past the end.
+*/
+__attribute__((target("ssse3")))
+static void rgba_to_bgr_ssse3( const int *src, unsigned char *dst, int n )
+{
+	const __m128i drop_alpha = _mm_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+	int i;
+
+	for(i=0;i+4<=n;i+=4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+		_mm_storeu_si128((__m128i *)dst,_mm_shuffle_epi8(v,drop_alpha));
+		dst += 12;
+	}
+	rgba_to_bgr_scalar(&src[i],dst,n-i);
+}
+#endif
+
+static void rgba_to_bgr( const int *src, unsigned char *dst, int n )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	static int ssse3 = -1;
+	if(ssse3 < 0) {
+		__builtin_cpu_init();
+		ssse3 = __builtin_cpu_supports("ssse3");
+	}
+	if(ssse3) {
+		rgba_to_bgr_ssse3(src,dst,n);
+		return;
+	}
+#endif
+	rgba_to_bgr_scalar(src,dst,n);
+}
+
+/*
+RLE8 bitmaps keep 8-bit gray levels, row by row, as runs of one level
+and stretches of literal levels.  A colour stores its luminance, which
+for a gray is exactly its level.
+*/
+
+#define RLE_MAX 255
+
+static unsigned char luminance( int rgba )
+{
+	return (77*GET_RED(rgba) + 150*GET_GREEN(rgba) + 29*GET_BLUE(rgba)) >> 8;
+}
+
+/* The longest run of one level starting at src[i], at most RLE_MAX. */
+static int run_length( const unsigned char *src, int i, int n )
+{
+	int k = i+1;
+	while(k<n && k-i<RLE_MAX && src[k]==src[i]) k++;
+	return k-i;
+}
+
+/* Encode one row of n levels into dst, returning its length. */
+static int rle_row( const unsigned char *src, int n, unsigned char *dst )
+{
+	unsigned char *start = dst;
+	int i = 0;
+
+	while(i<n) {
+		int run = run_length(src,i,n);
+		int lit;
+
+		if(run >= 3 || i+run == n) {
+			*dst++ = run;
+			*dst++ = src[i];
+			i += run;
+			continue;
+		}
+
+		/* literals run until the next run of three or more */
+		lit = run;
+		while(i+lit<n && lit<RLE_MAX) {
+			int r = run_length(src,i+lit,n);
+			if(r >= 3) break;
+			lit += r;
+		}
+		if(lit > RLE_MAX) lit = RLE_MAX;
+
+		/* absolute mode needs three or more, so fewer go as short runs */
+		if(lit < 3) {
+			*dst++ = run;
+			*dst++ = src[i];
+			i += run;
+			continue;
+		}
+
+		*dst++ = 0;
+		*dst++ = lit;
+		memcpy(dst,&src[i],lit);
+		dst += lit;
+		if(lit & 1) *dst++ = 0;
+		i += lit;
+	}
+
+	/* end of line */
+	*dst++ = 0;
+	*dst++ = 0;
+	return dst - start;
+}
+
+/*
+A bitmap stream writes an image file a few rows at a time, so an image
+never has to be in memory all at once.  The format follows the file
+name: a .png file is a PNG, a .rle file an RLE8 grayscale BMP, anything
+else a 24-bit BMP.  BMPs are written bottom row first with the header up
+front; an RLE8 header is filled in with the final size at the end.  A
+PNG is written top row first, so the caller hands over the bands of rows
+from the top of the image down when bitmap_stream_topdown() says so.
+*/
+
+enum { FORMAT_BMP, FORMAT_RLE, FORMAT_PNG };
+
+struct bitmap_stream {
+	FILE *file;
+	int format;
+	int width;
+	int height;
+	int row;
+	int rowlength;
+	int rows;
+	int ok;
+	unsigned char *buffer;
+	unsigned char *levels;
+	uint64_t written;
+	struct png_stream *png;
+};
+
+static int file_format( const char *path )
+{
+	size_t n = strlen(path);
+	if(n>=4 && !strcasecmp(path+n-4,".png")) return FORMAT_PNG;
+	if(n>=4 && !strcasecmp(path+n-4,".rle")) return FORMAT_RLE;
+	return FORMAT_BMP;
+}
+
+static void write_header( struct bitmap_stream *s )
+{
+	struct bmp_header header;
+	int offset = sizeof(header);
+	uint64_t imagesize;
+
+	if(s->format == FORMAT_RLE) {
+		offset += 256*4;
+		imagesize = s->written;
+	} else {
+		imagesize = (uint64_t)s->rowlength*s->height;
+	}
+
+	/* files past 4GB can't give their size, it is left 0 */
+	memset(&header,0,sizeof(header));
+	header.magic1 = 'B';
+	header.magic2 = 'M';
+	header.size   = offset + imagesize <= UINT32_MAX ? (uint32_t)(offset + imagesize) : 0;
+	header.offset = offset;
+	header.infosize = sizeof(header)-14;
+	header.width = s->width;
+	header.height = s->height;
+	header.planes = 1;
+	header.bits = s->format == FORMAT_RLE ? 8 : 24;
+	header.compression = s->format == FORMAT_RLE ? 1 : 0;
+	header.imagesize = imagesize <= UINT32_MAX ? (uint32_t)imagesize : 0;
+	header.xres = 1000;
+	header.yres = 1000;
+	header.ncolors = s->format == FORMAT_RLE ? 256 : 0;
+
+	if(fwrite(&header,1,sizeof(header),s->file) != sizeof(header)) s->ok = 0;
+
+	if(s->format == FORMAT_RLE) {
+		unsigned char grays[256*4];
+		int i;
+		for(i=0;i<256;i++) {
+			grays[i*4] = grays[i*4+1] = grays[i*4+2] = i;
+			grays[i*4+3] = 0;
+		}
+		if(fwrite(grays,1,sizeof(grays),s->file) != sizeof(grays)) s->ok = 0;
+	}
+}
+
+struct bitmap_stream * bitmap_stream_open( const char *path, int w, int h )
+{
+	struct bitmap_stream *s;
+
+	if(w<1 || h<1) return 0;
+
+	s = calloc(1,sizeof(*s));
+	if(!s) return 0;
+
+	s->format = file_format(path);
+	s->width = w;
+	s->height = h;
+	s->ok = 1;
+
+	if(s->format == FORMAT_BMP) {
+		/* if the scanline is not a multiple of four, round it up. */
+		s->rowlength = ((size_t)w*3 + 3) & ~(size_t)3;
+
+		/* as many rows as fit the buffer, but always at least one */
+		s->rows = SAVE_BUFFER / s->rowlength;
+		if(s->rows < 1) s->rows = 1;
+		if(s->rows > h) s->rows = h;
+
+		s->buffer = malloc((size_t)s->rows*s->rowlength + 16);
+		if(!s->buffer) goto fail;
+	} else if(s->format == FORMAT_RLE) {
+		/* at worst two bytes per level, and the end of line */
+		s->buffer = malloc((size_t)w*2 + 2);
+		s->levels = malloc(w);
+		if(!s->buffer || !s->levels) goto fail;
+	}
+
+	s->file = fopen(path,"wb");
+	if(!s->file) goto fail;
+
+	if(s->format == FORMAT_PNG) {
+		s->png = png_stream_open(s->file,w,h);
+		if(!s->png) {
+			fclose(s->file);
+			goto fail;
+		}
+	} else {
+		write_header(s);
+	}
+
+	return s;
+
+fail:
+	free(s->buffer);
+	free(s->levels);
+	free(s);
+	return 0;
+}
+
+/* Whether bands of rows go to this stream from the top of the image down. */
+int bitmap_stream_topdown( struct bitmap_stream *s )
+{
+	return s->format == FORMAT_PNG;
+}
+
+/*
+Write the next n rows of the image, given as RGBA pixels in the order
+they are in memory: the bottom of the image first, unless the stream is
+top down.
+*/
+int bitmap_stream_write( struct bitmap_stream *s, const int *rgba, int n )
+{
+	int padlength = s->rowlength - s->width*3;
+	unsigned char *b = s->buffer;
+	int i, j;
+
+	if(s->row + n > s->height) s->ok = 0;
+	if(!s->ok) return 0;
+
+	if(s->format == FORMAT_PNG) {
+		/* the rows of each band go in top row first */
+		s->ok = png_stream_write(s->png,&rgba[(size_t)(n-1)*s->width],n,-(long)s->width);
+		s->row += n;
+		return s->ok;
+	}
+
+	for(j=0;j<n && s->ok;j++) {
+		const int *row = &rgba[(size_t)j*s->width];
+
+		if(s->format == FORMAT_RLE) {
+			size_t length;
+			for(i=0;i<s->width;i++) s->levels[i] = luminance(row[i]);
+			length = rle_row(s->levels,s->width,s->buffer);
+			if(fwrite(s->buffer,1,length,s->file) != length) s->ok = 0;
+			s->written += length;
+			continue;
+		}
+
+		rgba_to_bgr(row,b,s->width);
+		memset(b+s->width*3,0,padlength);
+		b += s->rowlength;
+
+		if(b == s->buffer + (size_t)s->rows*s->rowlength || j == n-1) {
+			size_t length = b - s->buffer;
+			if(fwrite(s->buffer,1,length,s->file) != length) s->ok = 0;
+			b = s->buffer;
+		}
+	}
+
+	s->row += n;
+	return s->ok;
+}
+
+/* Finish the file.  Returns 1 if every row was written successfully. */
+int bitmap_stream_close( struct bitmap_stream *s )
+{
+	int ok = s->ok && s->row == s->height;
+
+	if(s->format == FORMAT_PNG) {
+		if(!png_stream_close(s->png)) ok = 0;
+	} else if(s->format == FORMAT_RLE && ok) {
+		/* end of bitmap, then the header gets the final size */
+		static const unsigned char end[2] = { 0, 1 };
+		if(fwrite(end,1,2,s->file) != 2) ok = 0;
+		s->written += 2;
+		if(fseek(s->file,0,SEEK_SET) != 0) ok = 0;
+		write_header(s);
+		if(!s->ok) ok = 0;
+	}
+
+	if(fclose(s->file) != 0) ok = 0;
+	free(s->buffer);
+	free(s->levels);
+	free(s);
+	return ok;
+}
+
+int bitmap_save( struct bitmap *m, const char *path )
+{
+	struct bitmap_stream *s;
+
+	s = bitmap_stream_open(path,m->width,m->height);
+	if(!s) return 0;
+
+	/* one band of every row, whichever way round the stream wants them */
+	bitmap_stream_write(s,m->data,m->height);
+	return bitmap_stream_close(s);
+}
+
+/*
+Loading maps the file and converts the pixels straight out of the
+mapping, a whole row at a time, instead of reading them through stdio.
+As before, black loads as 0 and every other colour gets an alpha of 255.
+*/
+
+/* Convert n BGR pixels to RGBA. */
+static void bgr_to_rgba_scalar( const unsigned char *src, int *dst, int n )
+{
+	int i;
+	for(i=0;i<n;i++) {
+		int b = *src++;
+		int g = *src++;
+		int r = *src++;
+		dst[i] = (b==0 && g==0 && r==0) ? 0 : MAKE_RGBA(r,g,b,255);
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/*
+The reverse of rgba_to_bgr_ssse3: one shuffle spreads four BGR pixels
+over four words, then the non-black ones get their alpha.  Each step
+loads 16 bytes but only uses 12, so it stops while a whole pixel of the
+row is still ahead, keeping the loads inside the row.
+*/
+__attribute__((target("ssse3")))
+static void bgr_to_rgba_ssse3( const unsigned char *src, int *dst, int n )
+{
+	const __m128i add_alpha = _mm_setr_epi8(0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1);
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	int i;
+
+	for(i=0;i+5<=n;i+=4) {
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src),add_alpha);
+		__m128i black = _mm_cmpeq_epi32(v,_mm_setzero_si128());
+		_mm_storeu_si128((__m128i *)&dst[i],_mm_or_si128(v,_mm_andnot_si128(black,alpha)));
+		src += 12;
+	}
+	bgr_to_rgba_scalar(src,&dst[i],n-i);
+}
+#endif
+
+static void bgr_to_rgba( const unsigned char *src, int *dst, int n )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	static int ssse3 = -1;
+	if(ssse3 < 0) {
+		__builtin_cpu_init();
+		ssse3 = __builtin_cpu_supports("ssse3");
+	}
+	if(ssse3) {
+		bgr_to_rgba_ssse3(src,dst,n);
+		return;
+	}
+#endif
+	bgr_to_rgba_scalar(src,dst,n);
+}
+
+struct bitmap * bitmap_load( const char *path )
+{
+	struct bitmap *m = 0;
+	struct bmp_header header;
+	struct stat info;
+	const unsigned char *file;
+	size_t rowlength;
+	int fd, width, height, topdown, j;
+
+	fd = open(path,O_RDONLY);
+	if(fd<0) return 0;
+
+	if(fstat(fd,&info)<0 || (size_t)info.st_size < sizeof(header)) {
+		printf("bitmap: %s is not a BMP file.\n",path);
+		close(fd);
+		return 0;
+	}
+
+	file = mmap(0,info.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(file==MAP_FAILED) return 0;
+	madvise((void *)file,info.st_size,MADV_SEQUENTIAL);
+
+	memcpy(&header,file,sizeof(header));
+
+	if(header.magic1!='B' || header.magic2!='M') {
+		printf("bitmap: %s is not a BMP file.\n",path);
+		goto done;
+	}
+
+	if(header.compression!=0 || header.bits!=24) {
+		printf("bitmap: sorry, I only support 24-bit uncompressed bitmaps.\n");
+		goto done;
+	}
+
+	/* a negative height means the rows are stored top row first */
+	width = header.width;
+	topdown = header.height < 0;
+	height = topdown ? -header.height : header.height;
+	rowlength = ((size_t)width*3 + 3) & ~(size_t)3;
+
+	if(width<1 || height<1 || header.offset<(int)sizeof(header) || (size_t)header.offset > (size_t)info.st_size
+	   || ((size_t)info.st_size - header.offset) / rowlength < (size_t)height) {
+		printf("bitmap: %s is damaged or truncated.\n",path);
+		goto done;
+	}
+
+	m = bitmap_create(width,height);
+	if(!m) goto done;
+
+	for(j=0;j<height;j++) {
+		int row = topdown ? height-1-j : j;
+		bgr_to_rgba(file + header.offset + (size_t)j*rowlength,bitmap_row(m,row),width);
+	}
+
+done:
+	munmap((void *)file,info.st_size);
+	return m;
+}
@@ -2,6 +2,18 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include <stddef.h>
+
+/*
+The fields are here only so the accessors below can be inlined;
+use the functions rather than the fields.
+*/
+struct bitmap {
+	int width;
+	int height;
+	int *data;
+};
+
 struct bitmap * bitmap_create( int w, int h );
 void            bitmap_delete( struct bitmap *b );
 struct bitmap * bitmap_load( const char *file );
@@ -14,6 +26,31 @@ int   bitmap_height( struct bitmap *b );
 void  bitmap_reset( struct bitmap *b, int value );
 int  *bitmap_data( struct bitmap *b );
 
+/*
+bitmap_get and bitmap_set wrap coordinates outside the image around to
+the other side.  These don't check at all, x and y must be inside.
+*/
+static inline int bitmap_get_fast( const struct bitmap *b, int x, int y )
+{
+	return b->data[(size_t)y*b->width+x];
+}
+
+static inline void bitmap_set_fast( struct bitmap *b, int x, int y, int value )
+{
+	b->data[(size_t)y*b->width+x] = value;
+}
+
+/* The pixels of row y, bitmap_width() of them. */
+static inline int * bitmap_row( struct bitmap *b, int y )
+{
+	return &b->data[(size_t)y*b->width];
+}
+
+struct bitmap_stream * bitmap_stream_open( const char *file, int w, int h );
+int             bitmap_stream_topdown( struct bitmap_stream *s );
+int             bitmap_stream_write( struct bitmap_stream *s, const int *rgba, int rows );
+int             bitmap_stream_close( struct bitmap_stream *s );
+
 #ifndef MAKE_RGBA
 /** Create a 32-bit RGBA value from 8-bit red, green, blue, and alpha values */
 #define MAKE_RGBA(r,g,b,a) ( (((int)(a))<<24) | (((int)(r))<<16) | (((int)(g))<<8) | (((int)(b))<<0) )
@@ -0,0 +1,229 @@
+
+#include "cache.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*
+The in-memory cache is direct mapped: a tile goes in the slot picked by
+its hash, replacing whatever was there.  The tiles of one image hash to
+different slots, so this only forgets tiles once well over CACHE_SLOTS
+of them have been rendered.
+*/
+
+#define CACHE_SLOTS 4096
+
+/*
+Start of every tile file, followed by the w*h iteration counts of the
+part of the tile it covers, starting a columns and b rows in.
+*/
+struct tile_file {
+	char magic[4];
+	int a;
+	int b;
+	int w;
+	int h;
+	int pad;
+	uint64_t salt;
+	struct tile_key key;
+};
+
+struct cache_slot {
+	uint64_t hash;
+	uint64_t salt;
+	struct tile_key key;
+	int a;
+	int b;
+	int w;
+	int h;
+	int *iters;
+};
+
+static int enabled = 0;
+static const char *cache_dir = 0;
+static uint64_t cache_salt;
+static struct cache_slot slots[CACHE_SLOTS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long hits = 0;
+static long misses = 0;
+
+int cache_enabled() {
+	return enabled;
+}
+
+long cache_hits() {
+	return hits;
+}
+
+long cache_misses() {
+	return misses;
+}
+
+/* 64 bit FNV-1a */
+static uint64_t hash_bytes( uint64_t h, const void *p, size_t n ) {
+	const unsigned char *s = p;
+	while(n--) {
+		h ^= *s++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t key_hash( const struct tile_key *key ) {
+	return hash_bytes(cache_salt,key,sizeof(*key));
+}
+
+static int key_equal( const struct tile_key *a, const struct tile_key *b ) {
+	return !memcmp(a,b,sizeof(*a));
+}
+
+/* Does the part (ea,eb,ew,eh) of a tile contain the part (a,b,w,h)? */
+static int covers( int ea, int eb, int ew, int eh, int a, int b, int w, int h ) {
+	return ea <= a && eb <= b && ea + ew >= a + w && eb + eh >= b + h;
+}
+
+/*
+Turn on the cache.  dir, if not null, is a directory for tile files,
+created if missing.  salt names anything else the counts depend on,
+such as kernel options, and keeps runs that differ in it apart.
+*/
+int cache_open( const char *dir, const char *salt ) {
+	cache_salt = hash_bytes(0xcbf29ce484222325ULL,salt,strlen(salt));
+	if(dir) {
+		if(mkdir(dir,0777) < 0 && access(dir,W_OK) < 0) return 0;
+		cache_dir = dir;
+	}
+	enabled = 1;
+	return 1;
+}
+
+static void tile_path( char *path, size_t n, uint64_t hash ) {
+	snprintf(path,n,"%s/%016llx.tile",cache_dir,(unsigned long long)hash);
+}
+
+static int file_get( uint64_t hash, const struct tile_key *key, int a, int b, int w, int h, int *iters, int stride ) {
+	char path[4096];
+	struct tile_file f;
+	int fd, j, ok = 0;
+
+	tile_path(path,sizeof(path),hash);
+	fd = open(path,O_RDONLY);
+	if(fd < 0) return 0;
+
+	if(read(fd,&f,sizeof(f)) == sizeof(f) && !memcmp(f.magic,"MTIL",4) &&
+	   f.salt == cache_salt && key_equal(&f.key,key) && covers(f.a,f.b,f.w,f.h,a,b,w,h)) {
+		ok = 1;
+		for(j = 0; j < h && ok; j++) {
+			off_t at = sizeof(f) + ((off_t)(b-f.b+j)*f.w + a-f.a)*sizeof(int);
+			ok = pread(fd,&iters[j*stride],w*sizeof(int),at) == (ssize_t)(w*sizeof(int));
+		}
+	}
+
+	close(fd);
+	return ok;
+}
+
+static void file_put( uint64_t hash, const struct tile_key *key, int a, int b, int w, int h, const int *iters, int stride ) {
+	char path[4096], tmp[4200];
+	struct tile_file f;
+	int fd, j, ok;
+
+	memset(&f,0,sizeof(f));
+	memcpy(f.magic,"MTIL",4);
+	f.a = a;
+	f.b = b;
+	f.w = w;
+	f.h = h;
+	f.salt = cache_salt;
+	f.key = *key;
+
+	/* write under a private name and rename, so readers never see half a tile */
+	tile_path(path,sizeof(path),hash);
+	snprintf(tmp,sizeof(tmp),"%s.%d.%lx",path,(int)getpid(),(unsigned long)pthread_self());
+	fd = open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0666);
+	if(fd < 0) return;
+
+	ok = write(fd,&f,sizeof(f)) == sizeof(f);
+	for(j = 0; j < h && ok; j++) {
+		ok = write(fd,&iters[j*stride],w*sizeof(int)) == (ssize_t)(w*sizeof(int));
+	}
+	close(fd);
+
+	if(!ok || rename(tmp,path) < 0) unlink(tmp);
+}
+
+static void memory_put( uint64_t hash, const struct tile_key *key, int a, int b, int w, int h, const int *iters, int stride ) {
+	struct cache_slot *s = &slots[hash % CACHE_SLOTS];
+	int *copy;
+	int j;
+
+	copy = malloc((size_t)w*h*sizeof(int));
+	if(!copy) return;
+	for(j = 0; j < h; j++) {
+		memcpy(&copy[j*w],&iters[j*stride],w*sizeof(int));
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	if(s->iters && s->hash == hash && s->salt == cache_salt && key_equal(&s->key,key) && covers(s->a,s->b,s->w,s->h,a,b,w,h)) {
+		/* already holds at least as much of this tile */
+		pthread_mutex_unlock(&cache_lock);
+		free(copy);
+		return;
+	}
+	free(s->iters);
+	s->hash = hash;
+	s->salt = cache_salt;
+	s->key = *key;
+	s->a = a;
+	s->b = b;
+	s->w = w;
+	s->h = h;
+	s->iters = copy;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+Copy the counts of the w x h part of the tile at key starting a columns
+and b rows in, which is all of it unless the image edge clips the tile,
+into iters, whose rows are stride ints apart.  Returns 1 on a hit, 0 if
+the tile has to be computed.  An entry stored for a larger part of the
+tile also serves a smaller one.
+*/
+int cache_get( const struct tile_key *key, int a, int b, int w, int h, int *iters, int stride ) {
+	uint64_t hash = key_hash(key);
+	struct cache_slot *s = &slots[hash % CACHE_SLOTS];
+	int j, hit = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	if(s->iters && s->hash == hash && s->salt == cache_salt && key_equal(&s->key,key) && covers(s->a,s->b,s->w,s->h,a,b,w,h)) {
+		for(j = 0; j < h; j++) {
+			memcpy(&iters[j*stride],&s->iters[(b-s->b+j)*s->w + a-s->a],w*sizeof(int));
+		}
+		hit = 1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	if(!hit && cache_dir) {
+		hit = file_get(hash,key,a,b,w,h,iters,stride);
+		/* keep it in memory for the next lookup */
+		if(hit) memory_put(hash,key,a,b,w,h,iters,stride);
+	}
+
+	__atomic_add_fetch(hit ? &hits : &misses,1,__ATOMIC_RELAXED);
+	return hit;
+}
+
+/* Store the counts of a freshly computed tile, laid out as for cache_get(). */
+void cache_put( const struct tile_key *key, int a, int b, int w, int h, const int *iters, int stride ) {
+	uint64_t hash = key_hash(key);
+
+	memory_put(hash,key,a,b,w,h,iters,stride);
+	if(cache_dir) file_put(hash,key,a,b,w,h,iters,stride);
+}
@@ -0,0 +1,37 @@
+
+#ifndef CACHE_H
+#define CACHE_H
+
+/*
+A cache of computed tiles, addressed by what determines their content:
+where the tile lies on the pixel grid, the spacing between pixels, the
+tile size and the iteration limit.  The grid is anchored at coordinate
+0 rather than at the image, so renders panned by whole pixels share
+tiles.  tx and ty count tiles from the origin and phase_x, phase_y give
+the sub-pixel offset of the whole grid.  Entries hold the iteration
+count of every pixel, so a render overlapping an earlier one only
+computes the tiles it hasn't seen.
+
+Entries are kept in memory and, if cache_open() was given a directory,
+also as one file per tile there, shared by every run using it.
+*/
+
+struct tile_key {
+	long long tx;
+	long long ty;
+	int phase_x;
+	int phase_y;
+	double dx;
+	double dy;
+	int size;
+	int max;
+};
+
+int   cache_open( const char *dir, const char *salt );
+int   cache_get( const struct tile_key *key, int a, int b, int w, int h, int *iters, int stride );
+void  cache_put( const struct tile_key *key, int a, int b, int w, int h, const int *iters, int stride );
+int   cache_enabled();
+long  cache_hits();
+long  cache_misses();
+
+#endif
@@ -0,0 +1,66 @@
+
+#include "counts.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A count file is this header followed by width*height floats, row by row. */
+struct counts_header {
+	char magic[4];
+	int width;
+	int height;
+	int max;
+};
+
+int counts_save( const char *path, const float *counts, int width, int height, int max ) {
+	FILE *file;
+	struct counts_header header;
+	size_t n = (size_t)width*height;
+	int ok;
+
+	file = fopen(path,"wb");
+	if(!file) return 0;
+
+	memcpy(header.magic,"MCNT",4);
+	header.width = width;
+	header.height = height;
+	header.max = max;
+
+	ok = fwrite(&header,sizeof(header),1,file) == 1 && fwrite(counts,sizeof(float),n,file) == n;
+	if(fclose(file) != 0) ok = 0;
+	return ok;
+}
+
+float * counts_load( const char *path, int *width, int *height, int *max ) {
+	FILE *file;
+	struct counts_header header;
+	float *counts;
+	size_t n;
+
+	file = fopen(path,"rb");
+	if(!file) return 0;
+
+	if(fread(&header,sizeof(header),1,file) != 1 || memcmp(header.magic,"MCNT",4) ||
+	   header.width < 1 || header.height < 1 || header.max < 1) {
+		fprintf(stderr,"counts: %s is not an iteration count file.\n",path);
+		fclose(file);
+		return 0;
+	}
+
+	n = (size_t)header.width*header.height;
+	counts = malloc(n*sizeof(float));
+	if(counts && fread(counts,sizeof(float),n,file) != n) {
+		fprintf(stderr,"counts: %s is truncated.\n",path);
+		free(counts);
+		counts = 0;
+	}
+
+	fclose(file);
+	if(counts) {
+		*width = header.width;
+		*height = header.height;
+		*max = header.max;
+	}
+	return counts;
+}
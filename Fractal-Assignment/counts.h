@@ -0,0 +1,13 @@
+
+#ifndef COUNTS_H
+#define COUNTS_H
+
+/*
+Iteration count files hold a rendered image before colouring, so it can
+be coloured again with another palette without computing it again.
+*/
+
+int     counts_save( const char *path, const float *counts, int width, int height, int max );
+float * counts_load( const char *path, int *width, int *height, int *max );
+
+#endif
@@ -0,0 +1,1079 @@
+
+#include "kernel.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNEL_X86
+#endif
+
+/*
+All kernels of one precision perform exactly the same operations in the
+same order, so every kernel produces identical images at that precision;
+the double kernels match kernel_iterations().  The Makefile builds this
+file with -ffp-contract=off so the compiler cannot fuse a multiply and
+add into an FMA, which rounds once instead of twice.
+*/
+
+/* Number of points found inside the main cardioid or the period-2 bulb. */
+static long interior_skipped = 0;
+
+/*
+Closed form membership tests for the two largest interior components.
+Points inside them never escape, so the iteration can be skipped and max
+returned directly.  The comparisons are strict so that points on the
+boundary, where rounding could go either way, are still iterated.
+*/
+
+static inline int in_cardioid_or_bulb( double x, double y ) {
+	double xq = x - 0.25;
+	double yy = y*y;
+	double q = xq*xq + yy;
+
+	if(q*(q + xq) < 0.25*yy) return 1;
+	return (x+1)*(x+1) + yy < 0.0625;
+}
+
+long kernel_skipped() {
+	return __atomic_load_n(&interior_skipped,__ATOMIC_RELAXED);
+}
+
+/*
+Iterations the kernels of this thread returned for skipped points but
+never ran: max for each point inside the cardioid or bulb, and what was
+left to max for each point stopped by the periodicity check.
+*/
+static __thread long thread_unrun = 0;
+
+long kernel_unrun() {
+	long unrun = thread_unrun;
+	thread_unrun = 0;
+	return unrun;
+}
+
+static void count_skipped( int n, int max ) {
+	if(!n) return;
+	__atomic_add_fetch(&interior_skipped,n,__ATOMIC_RELAXED);
+	thread_unrun += (long)n*max;
+}
+
+/*
+Periodicity checking, after Brent: z is saved at iterations 1, 2, 4, 8, ...
+and compared with every later z until the next save.  If z comes back to
+within PERIOD_EPSILON of the saved value the orbit has fallen into a
+cycle and the point is in the set, so max is returned without iterating
+further.  This changes results only for points whose orbit nearly, but
+not exactly, repeats before escaping, so it is off unless
+kernel_set_periodicity() turns it on.
+*/
+
+#define PERIOD_EPSILON 1e-12
+
+static int  periodicity = 0;
+static long periodic_stopped = 0;
+
+void kernel_set_periodicity( int on ) {
+	periodicity = on;
+}
+
+long kernel_periodic() {
+	return __atomic_load_n(&periodic_stopped,__ATOMIC_RELAXED);
+}
+
+static void count_periodic( int n ) {
+	if(n) __atomic_add_fetch(&periodic_stopped,n,__ATOMIC_RELAXED);
+}
+
+/*
+Return the number of iterations at point x, y
+in the Mandelbrot space, up to a maximum of max.
+*/
+
+static inline int iterate( double x, double y, int max, int *periodic ) {
+	double x0 = x;
+	double y0 = y;
+	double px = x;
+	double py = y;
+	int check = 0;
+	int window = 1;
+
+	int iter = 0;
+
+	while( (x*x + y*y <= 4) && iter < max ) {
+
+		double xt = x*x - y*y + x0;
+		double yt = 2*x*y + y0;
+
+		x = xt;
+		y = yt;
+
+		iter++;
+
+		if(periodicity) {
+			if(fabs(x-px) < PERIOD_EPSILON && fabs(y-py) < PERIOD_EPSILON) {
+				(*periodic)++;
+				thread_unrun += max - iter;
+				return max;
+			}
+			if(++check == window) {
+				check = 0;
+				window <<= 1;
+				px = x;
+				py = y;
+			}
+		}
+	}
+
+	return iter;
+}
+
+int kernel_iterations( double x, double y, int max ) {
+	int periodic = 0;
+	int iter;
+
+	if(in_cardioid_or_bulb(x,y)) {
+		count_skipped(1,max);
+		return max;
+	}
+
+	iter = iterate(x,y,max,&periodic);
+	count_periodic(periodic);
+	return iter;
+}
+
+static int scalar_points( const double *x, const double *y, int n, int max, int *iters, int *periodic ) {
+	int i, skipped = 0;
+	for(i=0;i<n;i++) {
+		if(in_cardioid_or_bulb(x[i],y[i])) {
+			iters[i] = max;
+			skipped++;
+		} else {
+			iters[i] = iterate(x[i],y[i],max,periodic);
+		}
+	}
+	return skipped;
+}
+
+static void kernel_scalar( const double *x, const double *y, int n, int max, int *iters ) {
+	int periodic = 0;
+	count_skipped(scalar_points(x,y,n,max,iters,&periodic),max);
+	count_periodic(periodic);
+}
+
+/*
+Shallow zooms don't need double precision.  The float kernels iterate
+the same recurrence in single precision, and the fixed point kernels in
+32-bit integers with FIX_BITS fraction bits, so a vector register holds
+twice as many lanes as it does doubles.  Fixed point resolves the same
+step everywhere in the set, finer than float does near |z| = 2.
+
+Fixed point numbers run out at +-16.  Products are only used while |x|
+and |y| are at most 2, which the escape test checks first, so the sums
+stay within +-10; constants are clamped to +-8, which escape at once
+anyway.  The interior check stays in double for every precision, so all
+of them skip the same points.
+*/
+
+#define FIX_BITS 27
+#define FIX_ONE  (1 << FIX_BITS)
+
+static inline int32_t fix_mul( int32_t a, int32_t b ) {
+	return (int32_t)(((int64_t)a * b) >> FIX_BITS);
+}
+
+static inline int32_t to_fixed( double v ) {
+	if(v > 8) v = 8;
+	if(v < -8) v = -8;
+	return (int32_t)lrint(v * FIX_ONE);
+}
+
+static inline int iterate_float( float x, float y, int max, int *periodic ) {
+	float x0 = x;
+	float y0 = y;
+	float px = x;
+	float py = y;
+	int check = 0;
+	int window = 1;
+
+	int iter = 0;
+
+	while( (x*x + y*y <= 4) && iter < max ) {
+
+		float xt = x*x - y*y + x0;
+		float yt = 2*x*y + y0;
+
+		x = xt;
+		y = yt;
+
+		iter++;
+
+		if(periodicity) {
+			if(fabsf(x-px) < (float)PERIOD_EPSILON && fabsf(y-py) < (float)PERIOD_EPSILON) {
+				(*periodic)++;
+				thread_unrun += max - iter;
+				return max;
+			}
+			if(++check == window) {
+				check = 0;
+				window <<= 1;
+				px = x;
+				py = y;
+			}
+		}
+	}
+
+	return iter;
+}
+
+static inline int iterate_fixed( int32_t x, int32_t y, int max, int *periodic ) {
+	int32_t x0 = x;
+	int32_t y0 = y;
+	int32_t px = x;
+	int32_t py = y;
+	int check = 0;
+	int window = 1;
+
+	int iter = 0;
+
+	while( iter < max ) {
+		int32_t xx, yy, xt, yt;
+
+		if(abs(x) > 2*FIX_ONE || abs(y) > 2*FIX_ONE) break;
+		xx = fix_mul(x,x);
+		yy = fix_mul(y,y);
+		if(xx + yy > 4*FIX_ONE) break;
+
+		xt = xx - yy + x0;
+		yt = 2*fix_mul(x,y) + y0;
+
+		x = xt;
+		y = yt;
+
+		iter++;
+
+		/* no step is smaller than one unit, so a cycle repeats exactly */
+		if(periodicity) {
+			if(x == px && y == py) {
+				(*periodic)++;
+				thread_unrun += max - iter;
+				return max;
+			}
+			if(++check == window) {
+				check = 0;
+				window <<= 1;
+				px = x;
+				py = y;
+			}
+		}
+	}
+
+	return iter;
+}
+
+static void kernel_scalar_float( const double *x, const double *y, int n, int max, int *iters ) {
+	int i, skipped = 0, periodic = 0;
+	for(i=0;i<n;i++) {
+		if(in_cardioid_or_bulb(x[i],y[i])) {
+			iters[i] = max;
+			skipped++;
+		} else {
+			iters[i] = iterate_float((float)x[i],(float)y[i],max,&periodic);
+		}
+	}
+	count_skipped(skipped,max);
+	count_periodic(periodic);
+}
+
+static void kernel_scalar_fixed( const double *x, const double *y, int n, int max, int *iters ) {
+	int i, skipped = 0, periodic = 0;
+	for(i=0;i<n;i++) {
+		if(in_cardioid_or_bulb(x[i],y[i])) {
+			iters[i] = max;
+			skipped++;
+		} else {
+			iters[i] = iterate_fixed(to_fixed(x[i]),to_fixed(y[i]),max,&periodic);
+		}
+	}
+	count_skipped(skipped,max);
+	count_periodic(periodic);
+}
+
+/*
+Convert the w points of the group starting at i to float, or to fixed
+point when fx is null, padding a short group as group_points() does.
+inside[j] is -1 for lanes inside the cardioid or bulb, 0 otherwise.
+Returns the number of real lanes.
+*/
+
+static inline int group_reduced( const double *x, const double *y, int i, int n, int w,
+		float *fx, float *fy, int32_t *qx, int32_t *qy, int32_t *inside ) {
+	int j, lanes = n - i < w ? n - i : w;
+
+	for(j=0;j<w;j++) {
+		int k = i + (j < lanes ? j : lanes-1);
+		if(fx) {
+			fx[j] = x[k];
+			fy[j] = y[k];
+		} else {
+			qx[j] = to_fixed(x[k]);
+			qy[j] = to_fixed(y[k]);
+		}
+		inside[j] = in_cardioid_or_bulb(x[k],y[k]) ? -1 : 0;
+	}
+	return lanes;
+}
+
+#ifdef KERNEL_X86
+
+/*
+The vector kernels iterate a group of lanes together.  A lane stays
+active while its point has not escaped; its count is bumped and its z
+updated only while active, so a lane's result is the same as the
+scalar loop's.  The group is done when no lane is active or max is hit.
+Lanes inside the cardioid or bulb start out inactive with a count of
+max, as do lanes caught by the periodicity check.  All lanes of a group
+share the iteration number, so they share the Brent save schedule.
+*/
+
+/*
+Point gx, gy at the w points of the group starting at i.  A short last
+group is padded with copies of its last point, so callers handing over
+only a few points still run vectorised; the padding lanes are computed
+and thrown away.  Returns the number of real lanes.
+*/
+
+static inline int group_points( const double *x, const double *y, int i, int n, int w,
+		double *tx, double *ty, const double **gx, const double **gy ) {
+	int j, lanes = n - i < w ? n - i : w;
+
+	if(lanes == w) {
+		*gx = &x[i];
+		*gy = &y[i];
+		return lanes;
+	}
+
+	for(j=0;j<w;j++) {
+		tx[j] = x[i + (j < lanes ? j : lanes-1)];
+		ty[j] = y[i + (j < lanes ? j : lanes-1)];
+	}
+	*gx = tx;
+	*gy = ty;
+	return lanes;
+}
+
+__attribute__((target("sse2")))
+static void kernel_sse2( const double *x, const double *y, int n, int max, int *iters ) {
+	const __m128d four = _mm_set1_pd(4.0);
+	const __m128d two = _mm_set1_pd(2.0);
+	const __m128d eps = _mm_set1_pd(PERIOD_EPSILON);
+	const __m128d sign = _mm_set1_pd(-0.0);
+	int i, j, k, skipped = 0, periodic = 0;
+
+	for(i=0; i<n; i+=2) {
+		double tx[2], ty[2];
+		const double *gx, *gy;
+		int lanes = group_points(x,y,i,n,2,tx,ty,&gx,&gy);
+		int real = (1 << lanes) - 1;
+		__m128d cx = _mm_loadu_pd(gx);
+		__m128d cy = _mm_loadu_pd(gy);
+		__m128d cyy = _mm_mul_pd(cy,cy);
+		__m128d zx = cx;
+		__m128d zy = cy;
+		__m128d px = zx;
+		__m128d py = zy;
+		int check = 0, window = 1;
+		long long out[2];
+
+		__m128d xq = _mm_sub_pd(cx,_mm_set1_pd(0.25));
+		__m128d q = _mm_add_pd(_mm_mul_pd(xq,xq),cyy);
+		__m128d x1 = _mm_add_pd(cx,_mm_set1_pd(1.0));
+		__m128d inside = _mm_or_pd(
+			_mm_cmplt_pd(_mm_mul_pd(q,_mm_add_pd(q,xq)),_mm_mul_pd(_mm_set1_pd(0.25),cyy)),
+			_mm_cmplt_pd(_mm_add_pd(_mm_mul_pd(x1,x1),cyy),_mm_set1_pd(0.0625)));
+		__m128d live = _mm_andnot_pd(inside,_mm_castsi128_pd(_mm_set1_epi64x(-1)));
+		__m128i count = _mm_and_si128(_mm_castpd_si128(inside),_mm_set1_epi64x(max));
+		skipped += __builtin_popcount(_mm_movemask_pd(inside) & real);
+
+		for(k=0; k<max; k++) {
+			__m128d xx = _mm_mul_pd(zx,zx);
+			__m128d yy = _mm_mul_pd(zy,zy);
+			__m128d active = _mm_and_pd(live,_mm_cmple_pd(_mm_add_pd(xx,yy),four));
+			if(!_mm_movemask_pd(active)) break;
+			live = active;
+
+			/* active lanes are all ones, i.e. -1 */
+			count = _mm_sub_epi64(count,_mm_castpd_si128(active));
+
+			__m128d xt = _mm_add_pd(_mm_sub_pd(xx,yy),cx);
+			__m128d yt = _mm_add_pd(_mm_mul_pd(_mm_mul_pd(two,zx),zy),cy);
+			zx = _mm_or_pd(_mm_and_pd(active,xt),_mm_andnot_pd(active,zx));
+			zy = _mm_or_pd(_mm_and_pd(active,yt),_mm_andnot_pd(active,zy));
+
+			if(periodicity) {
+				__m128d cycle = _mm_and_pd(live,_mm_and_pd(
+					_mm_cmplt_pd(_mm_andnot_pd(sign,_mm_sub_pd(zx,px)),eps),
+					_mm_cmplt_pd(_mm_andnot_pd(sign,_mm_sub_pd(zy,py)),eps)));
+				int m = _mm_movemask_pd(cycle);
+				if(m) {
+					__m128i cm = _mm_castpd_si128(cycle);
+					count = _mm_or_si128(_mm_and_si128(cm,_mm_set1_epi64x(max)),_mm_andnot_si128(cm,count));
+					live = _mm_andnot_pd(cycle,live);
+					periodic += __builtin_popcount(m & real);
+					thread_unrun += (long)__builtin_popcount(m & real)*(max-k-1);
+				}
+				if(++check == window) {
+					check = 0;
+					window <<= 1;
+					px = zx;
+					py = zy;
+				}
+			}
+		}
+
+		_mm_storeu_si128((__m128i *)out,count);
+		for(j=0;j<lanes;j++) iters[i+j] = out[j];
+	}
+
+	count_skipped(skipped,max);
+	count_periodic(periodic);
+}
+
+__attribute__((target("avx2")))
+static void kernel_avx2( const double *x, const double *y, int n, int max, int *iters ) {
+	const __m256d four = _mm256_set1_pd(4.0);
+	const __m256d two = _mm256_set1_pd(2.0);
+	const __m256d eps = _mm256_set1_pd(PERIOD_EPSILON);
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	int i, j, k, skipped = 0, periodic = 0;
+
+	for(i=0; i<n; i+=4) {
+		double tx[4], ty[4];
+		const double *gx, *gy;
+		int lanes = group_points(x,y,i,n,4,tx,ty,&gx,&gy);
+		int real = (1 << lanes) - 1;
+		__m256d cx = _mm256_loadu_pd(gx);
+		__m256d cy = _mm256_loadu_pd(gy);
+		__m256d cyy = _mm256_mul_pd(cy,cy);
+		__m256d zx = cx;
+		__m256d zy = cy;
+		__m256d px = zx;
+		__m256d py = zy;
+		int check = 0, window = 1;
+		long long out[4];
+
+		__m256d xq = _mm256_sub_pd(cx,_mm256_set1_pd(0.25));
+		__m256d q = _mm256_add_pd(_mm256_mul_pd(xq,xq),cyy);
+		__m256d x1 = _mm256_add_pd(cx,_mm256_set1_pd(1.0));
+		__m256d inside = _mm256_or_pd(
+			_mm256_cmp_pd(_mm256_mul_pd(q,_mm256_add_pd(q,xq)),_mm256_mul_pd(_mm256_set1_pd(0.25),cyy),_CMP_LT_OQ),
+			_mm256_cmp_pd(_mm256_add_pd(_mm256_mul_pd(x1,x1),cyy),_mm256_set1_pd(0.0625),_CMP_LT_OQ));
+		__m256d live = _mm256_andnot_pd(inside,_mm256_castsi256_pd(_mm256_set1_epi64x(-1)));
+		__m256i count = _mm256_and_si256(_mm256_castpd_si256(inside),_mm256_set1_epi64x(max));
+		skipped += __builtin_popcount(_mm256_movemask_pd(inside) & real);
+
+		for(k=0; k<max; k++) {
+			__m256d xx = _mm256_mul_pd(zx,zx);
+			__m256d yy = _mm256_mul_pd(zy,zy);
+			__m256d active = _mm256_and_pd(live,_mm256_cmp_pd(_mm256_add_pd(xx,yy),four,_CMP_LE_OQ));
+			if(!_mm256_movemask_pd(active)) break;
+			live = active;
+
+			count = _mm256_sub_epi64(count,_mm256_castpd_si256(active));
+
+			__m256d xt = _mm256_add_pd(_mm256_sub_pd(xx,yy),cx);
+			__m256d yt = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(two,zx),zy),cy);
+			zx = _mm256_blendv_pd(zx,xt,active);
+			zy = _mm256_blendv_pd(zy,yt,active);
+
+			if(periodicity) {
+				__m256d cycle = _mm256_and_pd(live,_mm256_and_pd(
+					_mm256_cmp_pd(_mm256_andnot_pd(sign,_mm256_sub_pd(zx,px)),eps,_CMP_LT_OQ),
+					_mm256_cmp_pd(_mm256_andnot_pd(sign,_mm256_sub_pd(zy,py)),eps,_CMP_LT_OQ)));
+				int m = _mm256_movemask_pd(cycle);
+				if(m) {
+					count = _mm256_castpd_si256(_mm256_blendv_pd(_mm256_castsi256_pd(count),
+						_mm256_castsi256_pd(_mm256_set1_epi64x(max)),cycle));
+					live = _mm256_andnot_pd(cycle,live);
+					periodic += __builtin_popcount(m & real);
+					thread_unrun += (long)__builtin_popcount(m & real)*(max-k-1);
+				}
+				if(++check == window) {
+					check = 0;
+					window <<= 1;
+					px = zx;
+					py = zy;
+				}
+			}
+		}
+
+		_mm256_storeu_si256((__m256i *)out,count);
+		for(j=0;j<lanes;j++) iters[i+j] = out[j];
+	}
+
+	count_skipped(skipped,max);
+	count_periodic(periodic);
+}
+
+__attribute__((target("avx512f")))
+static void kernel_avx512( const double *x, const double *y, int n, int max, int *iters ) {
+	const __m512d four = _mm512_set1_pd(4.0);
+	const __m512d two = _mm512_set1_pd(2.0);
+	const __m512i one = _mm512_set1_epi64(1);
+	const __m512d eps = _mm512_set1_pd(PERIOD_EPSILON);
+	int i, j, k, skipped = 0, periodic = 0;
+
+	for(i=0; i<n; i+=8) {
+		double tx[8], ty[8];
+		const double *gx, *gy;
+		int lanes = group_points(x,y,i,n,8,tx,ty,&gx,&gy);
+		int real = (1 << lanes) - 1;
+		__m512d cx = _mm512_loadu_pd(gx);
+		__m512d cy = _mm512_loadu_pd(gy);
+		__m512d cyy = _mm512_mul_pd(cy,cy);
+		__m512d zx = cx;
+		__m512d zy = cy;
+		__m512d px = zx;
+		__m512d py = zy;
+		int check = 0, window = 1;
+		long long out[8];
+
+		__m512d xq = _mm512_sub_pd(cx,_mm512_set1_pd(0.25));
+		__m512d q = _mm512_add_pd(_mm512_mul_pd(xq,xq),cyy);
+		__m512d x1 = _mm512_add_pd(cx,_mm512_set1_pd(1.0));
+		__mmask8 inside =
+			_mm512_cmp_pd_mask(_mm512_mul_pd(q,_mm512_add_pd(q,xq)),_mm512_mul_pd(_mm512_set1_pd(0.25),cyy),_CMP_LT_OQ) |
+			_mm512_cmp_pd_mask(_mm512_add_pd(_mm512_mul_pd(x1,x1),cyy),_mm512_set1_pd(0.0625),_CMP_LT_OQ);
+		__mmask8 live = ~inside;
+		__m512i count = _mm512_maskz_mov_epi64(inside,_mm512_set1_epi64(max));
+		skipped += __builtin_popcount(inside & real);
+
+		for(k=0; k<max; k++) {
+			__m512d xx = _mm512_mul_pd(zx,zx);
+			__m512d yy = _mm512_mul_pd(zy,zy);
+			__mmask8 active = live & _mm512_cmp_pd_mask(_mm512_add_pd(xx,yy),four,_CMP_LE_OQ);
+			if(!active) break;
+			live = active;
+
+			count = _mm512_mask_add_epi64(count,active,count,one);
+
+			__m512d xt = _mm512_add_pd(_mm512_sub_pd(xx,yy),cx);
+			__m512d yt = _mm512_add_pd(_mm512_mul_pd(_mm512_mul_pd(two,zx),zy),cy);
+			zx = _mm512_mask_mov_pd(zx,active,xt);
+			zy = _mm512_mask_mov_pd(zy,active,yt);
+
+			if(periodicity) {
+				__mmask8 cycle = live &
+					_mm512_cmp_pd_mask(_mm512_abs_pd(_mm512_sub_pd(zx,px)),eps,_CMP_LT_OQ) &
+					_mm512_cmp_pd_mask(_mm512_abs_pd(_mm512_sub_pd(zy,py)),eps,_CMP_LT_OQ);
+				if(cycle) {
+					count = _mm512_mask_mov_epi64(count,cycle,_mm512_set1_epi64(max));
+					live &= ~cycle;
+					periodic += __builtin_popcount(cycle & real);
+					thread_unrun += (long)__builtin_popcount(cycle & real)*(max-k-1);
+				}
+				if(++check == window) {
+					check = 0;
+					window <<= 1;
+					px = zx;
+					py = zy;
+				}
+			}
+		}
+
+		_mm512_storeu_si512(out,count);
+		for(j=0;j<lanes;j++) iters[i+j] = out[j];
+	}
+
+	count_skipped(skipped,max);
+	count_periodic(periodic);
+}
+
+__attribute__((target("sse2")))
+static void kernel_sse2_float( const double *x, const double *y, int n, int max, int *iters ) {
+	const __m128 four = _mm_set1_ps(4.0f);
+	const __m128 two = _mm_set1_ps(2.0f);
+	const __m128 eps = _mm_set1_ps((float)PERIOD_EPSILON);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	int i, j, k, skipped = 0, periodic = 0;
+
+	for(i=0; i<n; i+=4) {
+		float tx[4], ty[4];
+		int32_t in[4];
+		int lanes = group_reduced(x,y,i,n,4,tx,ty,0,0,in);
+		int real = (1 << lanes) - 1;
+		__m128 cx = _mm_loadu_ps(tx);
+		__m128 cy = _mm_loadu_ps(ty);
+		__m128 zx = cx;
+		__m128 zy = cy;
+		__m128 px = zx;
+		__m128 py = zy;
+		int check = 0, window = 1;
+		int out[4];
+
+		__m128 inside = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)in));
+		__m128 live = _mm_andnot_ps(inside,_mm_castsi128_ps(_mm_set1_epi32(-1)));
+		__m128i count = _mm_and_si128(_mm_castps_si128(inside),_mm_set1_epi32(max));
+		skipped += __builtin_popcount(_mm_movemask_ps(inside) & real);
+
+		for(k=0; k<max; k++) {
+			__m128 xx = _mm_mul_ps(zx,zx);
+			__m128 yy = _mm_mul_ps(zy,zy);
+			__m128 active = _mm_and_ps(live,_mm_cmple_ps(_mm_add_ps(xx,yy),four));
+			if(!_mm_movemask_ps(active)) break;
+			live = active;
+
+			count = _mm_sub_epi32(count,_mm_castps_si128(active));
+
+			__m128 xt = _mm_add_ps(_mm_sub_ps(xx,yy),cx);
+			__m128 yt = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(two,zx),zy),cy);
+			zx = _mm_or_ps(_mm_and_ps(active,xt),_mm_andnot_ps(active,zx));
+			zy = _mm_or_ps(_mm_and_ps(active,yt),_mm_andnot_ps(active,zy));
+
+			if(periodicity) {
+				__m128 cycle = _mm_and_ps(live,_mm_and_ps(
+					_mm_cmplt_ps(_mm_andnot_ps(sign,_mm_sub_ps(zx,px)),eps),
+					_mm_cmplt_ps(_mm_andnot_ps(sign,_mm_sub_ps(zy,py)),eps)));
+				int m = _mm_movemask_ps(cycle);
+				if(m) {
+					__m128i cm = _mm_castps_si128(cycle);
+					count = _mm_or_si128(_mm_and_si128(cm,_mm_set1_epi32(max)),_mm_andnot_si128(cm,count));
+					live = _mm_andnot_ps(cycle,live);
+					periodic += __builtin_popcount(m & real);
+					thread_unrun += (long)__builtin_popcount(m & real)*(max-k-1);
+				}
+				if(++check == window) {
+					check = 0;
+					window <<= 1;
+					px = zx;
+					py = zy;
+				}
+			}
+		}
+
+		_mm_storeu_si128((__m128i *)out,count);
+		for(j=0;j<lanes;j++) iters[i+j] = out[j];
+	}
+
+	count_skipped(skipped,max);
+	count_periodic(periodic);
+}
+
+__attribute__((target("avx2")))
+static void kernel_avx2_float( const double *x, const double *y, int n, int max, int *iters ) {
+	const __m256 four = _mm256_set1_ps(4.0f);
+	const __m256 two = _mm256_set1_ps(2.0f);
+	const __m256 eps = _mm256_set1_ps((float)PERIOD_EPSILON);
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	int i, j, k, skipped = 0, periodic = 0;
+
+	for(i=0; i<n; i+=8) {
+		float tx[8], ty[8];
+		int32_t in[8];
+		int lanes = group_reduced(x,y,i,n,8,tx,ty,0,0,in);
+		int real = (1 << lanes) - 1;
+		__m256 cx = _mm256_loadu_ps(tx);
+		__m256 cy = _mm256_loadu_ps(ty);
+		__m256 zx = cx;
+		__m256 zy = cy;
+		__m256 px = zx;
+		__m256 py = zy;
+		int check = 0, window = 1;
+		int out[8];
+
+		__m256 inside = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i *)in));
+		__m256 live = _mm256_andnot_ps(inside,_mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+		__m256i count = _mm256_and_si256(_mm256_castps_si256(inside),_mm256_set1_epi32(max));
+		skipped += __builtin_popcount(_mm256_movemask_ps(inside) & real);
+
+		for(k=0; k<max; k++) {
+			__m256 xx = _mm256_mul_ps(zx,zx);
+			__m256 yy = _mm256_mul_ps(zy,zy);
+			__m256 active = _mm256_and_ps(live,_mm256_cmp_ps(_mm256_add_ps(xx,yy),four,_CMP_LE_OQ));
+			if(!_mm256_movemask_ps(active)) break;
+			live = active;
+
+			count = _mm256_sub_epi32(count,_mm256_castps_si256(active));
+
+			__m256 xt = _mm256_add_ps(_mm256_sub_ps(xx,yy),cx);
+			__m256 yt = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(two,zx),zy),cy);
+			zx = _mm256_blendv_ps(zx,xt,active);
+			zy = _mm256_blendv_ps(zy,yt,active);
+
+			if(periodicity) {
+				__m256 cycle = _mm256_and_ps(live,_mm256_and_ps(
+					_mm256_cmp_ps(_mm256_andnot_ps(sign,_mm256_sub_ps(zx,px)),eps,_CMP_LT_OQ),
+					_mm256_cmp_ps(_mm256_andnot_ps(sign,_mm256_sub_ps(zy,py)),eps,_CMP_LT_OQ)));
+				int m = _mm256_movemask_ps(cycle);
+				if(m) {
+					count = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(count),
+						_mm256_castsi256_ps(_mm256_set1_epi32(max)),cycle));
+					live = _mm256_andnot_ps(cycle,live);
+					periodic += __builtin_popcount(m & real);
+					thread_unrun += (long)__builtin_popcount(m & real)*(max-k-1);
+				}
+				if(++check == window) {
+					check = 0;
+					window <<= 1;
+					px = zx;
+					py = zy;
+				}
+			}
+		}
+
+		_mm256_storeu_si256((__m256i *)out,count);
+		for(j=0;j<lanes;j++) iters[i+j] = out[j];
+	}
+
+	count_skipped(skipped,max);
+	count_periodic(periodic);
+}
+
+__attribute__((target("avx512f")))
+static void kernel_avx512_float( const double *x, const double *y, int n, int max, int *iters ) {
+	const __m512 four = _mm512_set1_ps(4.0f);
+	const __m512 two = _mm512_set1_ps(2.0f);
+	const __m512i one = _mm512_set1_epi32(1);
+	const __m512 eps = _mm512_set1_ps((float)PERIOD_EPSILON);
+	int i, j, k, skipped = 0, periodic = 0;
+
+	for(i=0; i<n; i+=16) {
+		float tx[16], ty[16];
+		int32_t in[16];
+		int lanes = group_reduced(x,y,i,n,16,tx,ty,0,0,in);
+		int real = (1 << lanes) - 1;
+		__m512 cx = _mm512_loadu_ps(tx);
+		__m512 cy = _mm512_loadu_ps(ty);
+		__m512 zx = cx;
+		__m512 zy = cy;
+		__m512 px = zx;
+		__m512 py = zy;
+		int check = 0, window = 1;
+		int out[16];
+
+		__mmask16 inside = _mm512_test_epi32_mask(_mm512_loadu_si512(in),_mm512_set1_epi32(-1));
+		__mmask16 live = ~inside;
+		__m512i count = _mm512_maskz_mov_epi32(inside,_mm512_set1_epi32(max));
+		skipped += __builtin_popcount(inside & real);
+
+		for(k=0; k<max; k++) {
+			__m512 xx = _mm512_mul_ps(zx,zx);
+			__m512 yy = _mm512_mul_ps(zy,zy);
+			__mmask16 active = live & _mm512_cmp_ps_mask(_mm512_add_ps(xx,yy),four,_CMP_LE_OQ);
+			if(!active) break;
+			live = active;
+
+			count = _mm512_mask_add_epi32(count,active,count,one);
+
+			__m512 xt = _mm512_add_ps(_mm512_sub_ps(xx,yy),cx);
+			__m512 yt = _mm512_add_ps(_mm512_mul_ps(_mm512_mul_ps(two,zx),zy),cy);
+			zx = _mm512_mask_mov_ps(zx,active,xt);
+			zy = _mm512_mask_mov_ps(zy,active,yt);
+
+			if(periodicity) {
+				__mmask16 cycle = live &
+					_mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(zx,px)),eps,_CMP_LT_OQ) &
+					_mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(zy,py)),eps,_CMP_LT_OQ);
+				if(cycle) {
+					count = _mm512_mask_mov_epi32(count,cycle,_mm512_set1_epi32(max));
+					live &= ~cycle;
+					periodic += __builtin_popcount(cycle & real);
+					thread_unrun += (long)__builtin_popcount(cycle & real)*(max-k-1);
+				}
+				if(++check == window) {
+					check = 0;
+					window <<= 1;
+					px = zx;
+					py = zy;
+				}
+			}
+		}
+
+		_mm512_storeu_si512(out,count);
+		for(j=0;j<lanes;j++) iters[i+j] = out[j];
+	}
+
+	count_skipped(skipped,max);
+	count_periodic(periodic);
+}
+
+/*
+fix_mul() on eight lanes.  The multiply takes the even 32-bit lanes to
+64-bit products, so the odd lanes go through a second one; each product
+is shifted so the wanted 32 bits land back in its own lane.
+*/
+__attribute__((target("avx2")))
+static inline __m256i fix_mul_avx2( __m256i a, __m256i b ) {
+	__m256i even = _mm256_srli_epi64(_mm256_mul_epi32(a,b),FIX_BITS);
+	__m256i odd = _mm256_slli_epi64(_mm256_mul_epi32(_mm256_srli_epi64(a,32),_mm256_srli_epi64(b,32)),32-FIX_BITS);
+	return _mm256_blend_epi32(even,odd,0xaa);
+}
+
+__attribute__((target("avx2")))
+static void kernel_avx2_fixed( const double *x, const double *y, int n, int max, int *iters ) {
+	const __m256i two = _mm256_set1_epi32(2*FIX_ONE);
+	const __m256i four = _mm256_set1_epi32(4*FIX_ONE);
+	int i, j, k, skipped = 0, periodic = 0;
+
+	for(i=0; i<n; i+=8) {
+		int32_t tx[8], ty[8], in[8];
+		int lanes = group_reduced(x,y,i,n,8,0,0,tx,ty,in);
+		int real = (1 << lanes) - 1;
+		__m256i cx = _mm256_loadu_si256((const __m256i *)tx);
+		__m256i cy = _mm256_loadu_si256((const __m256i *)ty);
+		__m256i zx = cx;
+		__m256i zy = cy;
+		__m256i px = zx;
+		__m256i py = zy;
+		int check = 0, window = 1;
+		int out[8];
+
+		__m256i inside = _mm256_loadu_si256((const __m256i *)in);
+		__m256i live = _mm256_andnot_si256(inside,_mm256_set1_epi32(-1));
+		__m256i count = _mm256_and_si256(inside,_mm256_set1_epi32(max));
+		skipped += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(inside)) & real);
+
+		for(k=0; k<max; k++) {
+			__m256i xx = fix_mul_avx2(zx,zx);
+			__m256i yy = fix_mul_avx2(zy,zy);
+			__m256i escaped = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpgt_epi32(_mm256_abs_epi32(zx),two),_mm256_cmpgt_epi32(_mm256_abs_epi32(zy),two)),
+				_mm256_cmpgt_epi32(_mm256_add_epi32(xx,yy),four));
+			__m256i active = _mm256_andnot_si256(escaped,live);
+			if(_mm256_testz_si256(active,active)) break;
+			live = active;
+
+			count = _mm256_sub_epi32(count,active);
+
+			__m256i xt = _mm256_add_epi32(_mm256_sub_epi32(xx,yy),cx);
+			__m256i yt = _mm256_add_epi32(_mm256_slli_epi32(fix_mul_avx2(zx,zy),1),cy);
+			zx = _mm256_blendv_epi8(zx,xt,active);
+			zy = _mm256_blendv_epi8(zy,yt,active);
+
+			if(periodicity) {
+				__m256i cycle = _mm256_and_si256(live,_mm256_and_si256(_mm256_cmpeq_epi32(zx,px),_mm256_cmpeq_epi32(zy,py)));
+				int m = _mm256_movemask_ps(_mm256_castsi256_ps(cycle));
+				if(m) {
+					count = _mm256_blendv_epi8(count,_mm256_set1_epi32(max),cycle);
+					live = _mm256_andnot_si256(cycle,live);
+					periodic += __builtin_popcount(m & real);
+					thread_unrun += (long)__builtin_popcount(m & real)*(max-k-1);
+				}
+				if(++check == window) {
+					check = 0;
+					window <<= 1;
+					px = zx;
+					py = zy;
+				}
+			}
+		}
+
+		_mm256_storeu_si256((__m256i *)out,count);
+		for(j=0;j<lanes;j++) iters[i+j] = out[j];
+	}
+
+	count_skipped(skipped,max);
+	count_periodic(periodic);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i fix_mul_avx512( __m512i a, __m512i b ) {
+	__m512i even = _mm512_srli_epi64(_mm512_mul_epi32(a,b),FIX_BITS);
+	__m512i odd = _mm512_slli_epi64(_mm512_mul_epi32(_mm512_srli_epi64(a,32),_mm512_srli_epi64(b,32)),32-FIX_BITS);
+	return _mm512_mask_blend_epi32(0xaaaa,even,odd);
+}
+
+__attribute__((target("avx512f")))
+static void kernel_avx512_fixed( const double *x, const double *y, int n, int max, int *iters ) {
+	const __m512i two = _mm512_set1_epi32(2*FIX_ONE);
+	const __m512i four = _mm512_set1_epi32(4*FIX_ONE);
+	const __m512i one = _mm512_set1_epi32(1);
+	int i, j, k, skipped = 0, periodic = 0;
+
+	for(i=0; i<n; i+=16) {
+		int32_t tx[16], ty[16], in[16];
+		int lanes = group_reduced(x,y,i,n,16,0,0,tx,ty,in);
+		int real = (1 << lanes) - 1;
+		__m512i cx = _mm512_loadu_si512(tx);
+		__m512i cy = _mm512_loadu_si512(ty);
+		__m512i zx = cx;
+		__m512i zy = cy;
+		__m512i px = zx;
+		__m512i py = zy;
+		int check = 0, window = 1;
+		int out[16];
+
+		__mmask16 inside = _mm512_test_epi32_mask(_mm512_loadu_si512(in),_mm512_set1_epi32(-1));
+		__mmask16 live = ~inside;
+		__m512i count = _mm512_maskz_mov_epi32(inside,_mm512_set1_epi32(max));
+		skipped += __builtin_popcount(inside & real);
+
+		for(k=0; k<max; k++) {
+			__m512i xx = fix_mul_avx512(zx,zx);
+			__m512i yy = fix_mul_avx512(zy,zy);
+			__mmask16 active = live &
+				_mm512_cmple_epi32_mask(_mm512_abs_epi32(zx),two) &
+				_mm512_cmple_epi32_mask(_mm512_abs_epi32(zy),two) &
+				_mm512_cmple_epi32_mask(_mm512_add_epi32(xx,yy),four);
+			if(!active) break;
+			live = active;
+
+			count = _mm512_mask_add_epi32(count,active,count,one);
+
+			__m512i xt = _mm512_add_epi32(_mm512_sub_epi32(xx,yy),cx);
+			__m512i yt = _mm512_add_epi32(_mm512_slli_epi32(fix_mul_avx512(zx,zy),1),cy);
+			zx = _mm512_mask_mov_epi32(zx,active,xt);
+			zy = _mm512_mask_mov_epi32(zy,active,yt);
+
+			if(periodicity) {
+				__mmask16 cycle = live & _mm512_cmpeq_epi32_mask(zx,px) & _mm512_cmpeq_epi32_mask(zy,py);
+				if(cycle) {
+					count = _mm512_mask_mov_epi32(count,cycle,_mm512_set1_epi32(max));
+					live &= ~cycle;
+					periodic += __builtin_popcount(cycle & real);
+					thread_unrun += (long)__builtin_popcount(cycle & real)*(max-k-1);
+				}
+				if(++check == window) {
+					check = 0;
+					window <<= 1;
+					px = zx;
+					py = zy;
+				}
+			}
+		}
+
+		_mm512_storeu_si512(out,count);
+		for(j=0;j<lanes;j++) iters[i+j] = out[j];
+	}
+
+	count_skipped(skipped,max);
+	count_periodic(periodic);
+}
+
+#endif
+
+kernel_func  kernel_points = kernel_scalar;
+const char  *kernel_name = "scalar";
+
+/*
+The kernels of each instruction set at every precision, and whether
+fixed point and float are any cheaper than double there.  They only are
+with twice the lanes: one at a time, every precision waits on the same
+chain of multiplies.  Without vector fixed point in SSE2 the scalar
+kernel stands in.
+*/
+
+static const struct {
+	int fixed_cheaper;
+	int float_cheaper;
+	kernel_func points[3];
+	const char *names[3];
+} kernels[] = {
+	{ 0, 0, { kernel_scalar, kernel_scalar_fixed, kernel_scalar_float }, { "scalar", "scalar-fixed", "scalar-float" } },
+#ifdef KERNEL_X86
+	{ 0, 1, { kernel_sse2,   kernel_scalar_fixed, kernel_sse2_float },   { "sse2",   "scalar-fixed", "sse2-float" } },
+	{ 1, 1, { kernel_avx2,   kernel_avx2_fixed,   kernel_avx2_float },   { "avx2",   "avx2-fixed",   "avx2-float" } },
+	{ 1, 1, { kernel_avx512, kernel_avx512_fixed, kernel_avx512_float }, { "avx512", "avx512-fixed", "avx512-float" } },
+#endif
+};
+
+static int chosen = 0;
+
+/*
+Select a kernel by name: "scalar", "sse2", "avx2", "avx512", or "auto"
+for the widest one this CPU supports.  Returns 0 if the named kernel
+does not exist or the CPU cannot run it.  The kernel starts out in
+double precision.
+*/
+
+int kernel_init( const char *name ) {
+	int automatic = !strcmp(name,"auto");
+	int ok = automatic || !strcmp(name,"scalar");
+
+	chosen = 0;
+
+#ifdef KERNEL_X86
+	__builtin_cpu_init();
+
+	if((automatic || !strcmp(name,"avx512")) && __builtin_cpu_supports("avx512f")) {
+		chosen = 3;
+		ok = 1;
+	} else if((automatic || !strcmp(name,"avx2")) && __builtin_cpu_supports("avx2")) {
+		chosen = 2;
+		ok = 1;
+	} else if((automatic || !strcmp(name,"sse2")) && __builtin_cpu_supports("sse2")) {
+		chosen = 1;
+		ok = 1;
+	}
+#endif
+
+	kernel_set_precision(PRECISION_DOUBLE);
+	return ok;
+}
+
+/* Switch the chosen kernel to another precision. */
+void kernel_set_precision( int precision ) {
+	kernel_points = kernels[chosen].points[precision];
+	kernel_name = kernels[chosen].names[precision];
+}
+
+/*
+The cheapest precision for the chosen kernel that still tells apart
+points spacing apart, with PRECISION_MARGIN bits to spare for the
+rounding errors the iteration piles up.  A float steps by at most 2^-22
+below |z| = 2, fixed point by 2^-FIX_BITS everywhere.  Rounding errors
+grow along an orbit like any other nudge to the point, so they have to
+start well below the thousandth of the spacing (2^-10) that already
+changes counts.  There is no bound for chaotic orbits; on the views of
+bench.sh and the -h examples, a 15 bit margin gives counts that differ
+from double's at about half as many pixels as moving the view by a
+thousandth of the spacing does, and 8 bits differed at more.
+*/
+
+#define PRECISION_MARGIN 15
+
+int kernel_precision_for( double spacing ) {
+	if(kernels[chosen].float_cheaper && spacing >= ldexp(1,PRECISION_MARGIN-22)) return PRECISION_FLOAT;
+	if(kernels[chosen].fixed_cheaper && spacing >= ldexp(1,PRECISION_MARGIN-FIX_BITS)) return PRECISION_FIXED;
+	return PRECISION_DOUBLE;
+}
+
+/*
+Smooth counts, for palettes that should not show bands.  A point's
+integer count comes from a kernel; every kernel computes the same orbit
+as iterate(), so iterating an escaped point that many times again gives
+back the z it escaped with.  A few more steps take |z| far out, where
+n + 1 - log2(log |z|) varies continuously across the image.  Points that
+did not escape keep max.  Periodicity and interior checks don't matter
+here, those points are at max already.
+*/
+
+#define SMOOTH_BAILOUT 1e10
+
+void kernel_smooth( const double *x, const double *y, const int *iters, int n, int max, float *counts ) {
+	int k, i;
+
+	for(k = 0; k < n; k++) {
+		double zx = x[k], zy = y[k], mu;
+
+		if(iters[k] >= max) {
+			counts[k] = max;
+			continue;
+		}
+
+		for(i = 0; i < iters[k] || (zx*zx + zy*zy <= SMOOTH_BAILOUT && i < iters[k] + 8); i++) {
+			double xt = zx*zx - zy*zy + x[k];
+			double yt = 2*zx*zy + y[k];
+			zx = xt;
+			zy = yt;
+		}
+
+		mu = i + 1 - log2(0.5*log(zx*zx + zy*zy));
+		if(mu < 0) mu = 0;
+		if(mu > max) mu = max;
+		counts[k] = mu;
+	}
+}
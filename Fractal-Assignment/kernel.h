@@ -0,0 +1,28 @@
+
+#ifndef KERNEL_H
+#define KERNEL_H
+
+/*
+A kernel computes the escape iteration count, limited to max, of the n
+points (x[0],y[0]) ... (x[n-1],y[n-1]).
+*/
+typedef void (*kernel_func)( const double *x, const double *y, int n, int max, int *iters );
+
+/* The arithmetic a kernel iterates in, from the most precise. */
+enum { PRECISION_DOUBLE, PRECISION_FIXED, PRECISION_FLOAT };
+
+int   kernel_iterations( double x, double y, int max );
+int   kernel_init( const char *name );
+void  kernel_set_precision( int precision );
+int   kernel_precision_for( double spacing );
+long  kernel_skipped();
+void  kernel_set_periodicity( int on );
+long  kernel_periodic();
+long  kernel_unrun();
+void  kernel_smooth( const double *x, const double *y, const int *iters, int n, int max, float *counts );
+
+/* The kernel picked by kernel_init() and its name. */
+extern kernel_func  kernel_points;
+extern const char  *kernel_name;
+
+#endif
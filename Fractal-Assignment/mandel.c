@@ -1,5 +1,13 @@
 
 #include "bitmap.h"
+#include "kernel.h"
+#include "perturb.h"
+#include "cache.h"
+#include "pool.h"
+#include "palette.h"
+#include "counts.h"
+#include "stats.h"
+#include "png.h"
 
 #include <getopt.h>
 #include <stdlib.h>
@@ -7,26 +15,90 @@
 #include <math.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <pthread.h>
 #include <time.h>
 
-struct thread_payload {
-	struct bitmap * bm;
+/* Images are split into TILE_SIZE x TILE_SIZE tiles, the unit of work handed to threads */
+#define TILE_SIZE 32
+
+/*
+ * A contiguous range [head, tail) of tile indices owned by one thread.
+ * The owner takes tiles from the head, idle threads steal from the tail.
+ */
+struct tile_queue {
+	pthread_mutex_t lock;
+	int head;
+	int tail;
+} __attribute__((aligned(64)));
+
+/* How the pixels of a tile are found */
+enum render_mode {
+	RENDER_PIXEL,		/* iterate every pixel */
+	RENDER_MARIANI_SILVER	/* iterate rectangle borders, fill uniform rectangles */
+};
+
+/* Everything describing one render, shared by all of its threads */
+struct render_job {
+	float * counts;
 	double xmin;
 	double xmax;
 	double ymin;
 	double ymax;
-	int chunk_bottom;
-	int chunk_top;
 	int max;
 	int width;
 	int height;
+	int row0;
+	int image_height;
+	int tiles_x;
+	int tiles_y;
+	int threads;
+	int mode;
+	int step;
+	int coarse;
+	int cache;
+	int smooth;
+	int ox;
+	int oy;
+	struct tile_key key;
+	int * tiles;
+	struct tile_queue * queues;
 };
 
-int iteration_to_color( int i, int max );
-int iterations_at_point( double x, double y, int max );
-void compute_image(struct bitmap *bm, double xmin, double xmax, double ymin, double ymax, int max, int threads);
-void * compute_chunk(void * args);
+void compute_image(float *counts, int width, int height, double xmin, double xmax, double ymin, double ymax, int max, int mode, int step, int coarse);
+void compute_band(float *counts, int width, int height, int row0, int rows, double xmin, double xmax, double ymin, double ymax, int max, int mode);
+int band_skew(int height, double ymin);
+int render_stream(const char *outfile, int width, int height, double xmin, double xmax, double ymin, double ymax, int max, int mode, palette_func palette);
+void color_image(struct bitmap *bm, const float *counts, int max, palette_func palette);
+void color_counts(int *rgba, const float *counts, long n, int max, palette_func palette);
+void compute_chunk(void * args, int id);
+void compute_tile(struct render_job *job, int tile);
+void compute_tile_ms(struct render_job *job, int tile);
+int render_batch(const char *keyfile, int frames, const char *pattern, int width, int height, int mode, int deep, int precision, const char *cachedir, int periodicity, palette_func palette);
+
+/* Below this scale doubles cannot tell neighbouring pixels apart, switch to perturbation */
+#define DEEP_ZOOM_SCALE 1e-12
+
+/* -f auto: let the pixel spacing pick a kernel precision */
+#define PRECISION_AUTO -1
+
+/* Pixel spacing of the first progressive pass, each later pass halves it */
+#define PROGRESSIVE_STEP 4
+
+/* Cached tiles line up when image origins agree to 1/CACHE_PHASES of a pixel */
+#define CACHE_PHASES 4096
+
+/* Frames rendered by -b when -n isn't given */
+#define BATCH_FRAMES 100
+
+/* Pixels filled in by Mariani-Silver without being iterated */
+static long ms_filled = 0;
+
+/* Store fractional, smooth iteration counts (-S) */
+static int smooth_counts = 0;
+
+/* Scale of the render the tile cache was opened for, see cache_align() */
+static double cache_scale = 0;
 
 void show_help() {
 	printf("Use: mandel [options]\n");
@@ -37,17 +109,129 @@ void show_help() {
 	printf("-s <scale>  Scale of the image in Mandlebrot coordinates. (default=4)\n");
 	printf("-W <pixels> Width of the image in pixels. (default=500)\n");
 	printf("-H <pixels> Height of the image in pixels. (default=500)\n");
-	printf("-o <file>   Set output file. (default=mandel.bmp)\n");
+	printf("-o <file>   Set output file: .png for PNG, .rle for a grayscale RLE8 BMP, else a BMP. (default=mandel.bmp)\n");
 	printf("-t <threads>   Set number of threads. (default=1)\n");
+	printf("-a          Pin each thread to its own CPU. (default=off)\n");
+	printf("-k <kernel> Iteration kernel: auto, scalar, sse2, avx2 or avx512. (default=auto)\n");
+	printf("-f <prec>   Arithmetic: double, fixed (32-bit fixed point), float, or auto for the cheapest\n");
+	printf("            that resolves the pixel spacing, double for -S. (default=auto)\n");
+	printf("-p          Stop iterating points whose orbit becomes periodic. (default=off)\n");
+	printf("-d          Deep zoom: perturbation against a high precision reference orbit. (default=on below scale %g)\n",DEEP_ZOOM_SCALE);
+	printf("-r <mode>   Render mode: pixel, or ms to fill rectangles with a uniform border (Mariani-Silver). (default=pixel)\n");
+	printf("-c <dir>    Cache the iteration counts of computed tiles in dir and reuse them. (default=off)\n");
+	printf("-P          Progressive: render at 1/16 and 1/4 of the pixels before the full image. (default=off)\n");
+	printf("-w          Write the image to the output file after every progressive pass, implies -P. (default=off)\n");
+	printf("-C <name>   Colour palette: %s. (default=gray)\n",palette_names());
+	printf("-S          Compute smooth, fractional iteration counts, blending palette colours. Not in deep zoom. (default=off)\n");
+	printf("-L          Insist on computing and writing the image in bands of rows, never holding all of it.\n");
+	printf("            (default=on unless -P, -w or -I need the whole image)\n");
+	printf("-I <file>   Also save the iteration counts to file, to colour again later. (default=off)\n");
+	printf("-i <file>   Colour the iteration counts saved in file instead of computing an image.\n");
+	printf("-J <file>   Write the compute time, throughput and per-thread load of the render to file as JSON. (default=off)\n");
+	printf("-T <file>   Write a timeline of every tile and idle wait of each thread, and a heatmap of tile cost,\n");
+	printf("            to file as a Chrome trace (chrome://tracing, Perfetto). (default=off)\n");
+	printf("-b <file>   Batch: render a zoom sequence through the keyframes in file, one \"x y scale max\" per line.\n");
+	printf("-n <frames> Number of frames rendered by -b. (default=%d)\n",BATCH_FRAMES);
 	printf("-h          Show this help text.\n");
 	printf("\nSome examples are:\n");
 	printf("mandel -x -0.5 -y -0.5 -s 0.2\n");
 	printf("mandel -x -.38 -y -.665 -s .05 -m 100\n");
-	printf("mandel -x 0.286932 -y 0.014287 -s .0005 -m 1000\n\n");
+	printf("mandel -x 0.286932 -y 0.014287 -s .0005 -m 1000\n");
+	printf("mandel -b zoom.txt -n 300 -o frame%%04d.bmp\n\n");
+}
+
+/*
+The precision for a render of width x height pixels at scale: the one
+asked for, or for PRECISION_AUTO the cheapest that resolves the pixel
+spacing.  Smooth counts are worked out again in double from the integer
+counts, so they need the counts of the double kernel.
+*/
+
+static int choose_precision( int precision, double scale, int width, int height ) {
+	if(precision != PRECISION_AUTO) return precision;
+	if(smooth_counts) return PRECISION_DOUBLE;
+	return kernel_precision_for(2*scale/(width > height ? width : height));
+}
+
+/*
+Pick the kernel for a render: the one kernel_init() chose at the given
+precision, or when deep the perturbation kernel around the centre (x,y),
+given as strings.
+*/
+
+static int set_kernel( int deep, int precision, const char *x, const char *y, int max ) {
+	if(!deep) {
+		kernel_set_precision(precision);
+		return 1;
+	}
+
+	if(!perturb_init(x,y,max)) {
+		fprintf(stderr,"mandel: couldn't compute the reference orbit at %s,%s\n",x,y);
+		return 0;
+	}
+	kernel_points = perturb_points;
+	kernel_name = "perturb";
+	return 1;
+}
+
+/*
+Point the tile cache at dir.  Cached counts are only valid for the same
+kernel options, precision and render mode (Mariani-Silver fills in
+counts it never iterated), and in deep zoom the same centre.  Tiles are
+keyed by the pixel spacing of scale.
+*/
+
+static int open_cache( const char *dir, int periodicity, int deep, int precision, int mode, double scale, const char *x, const char *y ) {
+	char salt[1024];
+
+	cache_scale = scale;
+
+	snprintf(salt,sizeof(salt),"periodicity=%d deep=%d precision=%d mode=%d %s %s",periodicity,deep,deep ? PRECISION_DOUBLE : precision,mode,deep ? x : "",deep ? y : "");
+	if(!cache_open(dir,salt)) {
+		fprintf(stderr,"mandel: couldn't use cache directory %s: %s\n",dir,strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+/*
+Report what the speedups did for a render of n pixels.
+*/
+
+static void print_stats( int deep, int mode, long n ) {
+	if(deep) {
+		printf("mandel: %ld rebases onto the reference orbit\n",perturb_rebases());
+	} else {
+		printf("mandel: %ld of %ld pixels skipped by the cardioid/bulb check, %ld stopped by the periodicity check\n",kernel_skipped(),n,kernel_periodic());
+	}
+	if(mode == RENDER_MARIANI_SILVER) {
+		printf("mandel: %ld pixels filled by Mariani-Silver\n",ms_filled);
+	}
+	if(cache_enabled()) {
+		printf("mandel: %ld tiles found in the cache, %ld computed\n",cache_hits(),cache_misses());
+	}
+}
+
+/*
+Write the render statistics of a single image to statsfile (-J), and its
+trace to tracefile (-T), either of which may be null.
+*/
+
+static int save_stats( const char *statsfile, const char *tracefile, const char *x, const char *y, double scale, int width, int height, int max ) {
+	if(statsfile && !stats_write(statsfile,x,y,scale,width,height,max,kernel_name)) {
+		fprintf(stderr,"mandel: couldn't write to %s: %s\n",statsfile,strerror(errno));
+		return 0;
+	}
+	if(tracefile && !stats_write_trace(tracefile)) {
+		fprintf(stderr,"mandel: couldn't write to %s: %s\n",tracefile,strerror(errno));
+		return 0;
+	}
+	return 1;
 }
 
 int main( int argc, char *argv[] ) {
 	char c;
+	int ok;
 
 	// These are the default configuration values used
 	// if no command line arguments are given.
@@ -55,22 +239,44 @@ int main( int argc, char *argv[] ) {
 	const char *outfile = "mandel.bmp";
 	double xcenter = 0;
 	double ycenter = 0;
+	const char *xstring = "0";
+	const char *ystring = "0";
+	int    deep = 0;
 	double scale = 4;
 	int    image_width = 500;
 	int    image_height = 500;
 	int    max = 1000;
 	int    threads = 1;
+	int    pin = 0;
+	const char *kernel = "auto";
+	int    precision = PRECISION_AUTO;
+	int    mode = RENDER_PIXEL;
+	int    progressive = 0;
+	int    preview = 0;
+	int    step;
+	int    periodicity = 0;
+	const char *cachedir = 0;
+	const char *keyfile = 0;
+	int    frames = BATCH_FRAMES;
+	palette_func palette = palette_find("gray");
+	const char *countsout = 0;
+	const char *countsin = 0;
+	int    stream = 0;
+	const char *statsfile = 0;
+	const char *tracefile = 0;
 
 	// For each command line argument given,
 	// override the appropriate configuration value.
 
-	while((c = getopt(argc,argv,"x:y:s:W:H:m:o:t:h"))!=-1) {
+	while((c = getopt(argc,argv,"x:y:s:W:H:m:o:t:ak:f:pr:dPwc:b:n:C:SI:i:LJ:T:h"))!=-1) {
 		switch(c) {
 			case 'x':
 				xcenter = atof(optarg);
+				xstring = optarg;
 				break;
 			case 'y':
 				ycenter = atof(optarg);
+				ystring = optarg;
 				break;
 			case 's':
 				scale = atof(optarg);
@@ -90,6 +296,84 @@ int main( int argc, char *argv[] ) {
 			case 't':
 				threads = atoi(optarg);
 				break;
+			case 'a':
+				pin = 1;
+				break;
+			case 'k':
+				kernel = optarg;
+				break;
+			case 'p':
+				kernel_set_periodicity(1);
+				periodicity = 1;
+				break;
+			case 'd':
+				deep = 1;
+				break;
+			case 'P':
+				progressive = 1;
+				break;
+			case 'w':
+				progressive = 1;
+				preview = 1;
+				break;
+			case 'c':
+				cachedir = optarg;
+				break;
+			case 'b':
+				keyfile = optarg;
+				break;
+			case 'n':
+				frames = atoi(optarg);
+				break;
+			case 'C':
+				palette = palette_find(optarg);
+				if(!palette) {
+					fprintf(stderr,"mandel: unknown palette %s\n",optarg);
+					exit(1);
+				}
+				break;
+			case 'S':
+				smooth_counts = 1;
+				break;
+			case 'I':
+				countsout = optarg;
+				break;
+			case 'i':
+				countsin = optarg;
+				break;
+			case 'L':
+				stream = 1;
+				break;
+			case 'J':
+				statsfile = optarg;
+				break;
+			case 'T':
+				tracefile = optarg;
+				break;
+			case 'f':
+				if(!strcmp(optarg,"auto")) {
+					precision = PRECISION_AUTO;
+				} else if(!strcmp(optarg,"double")) {
+					precision = PRECISION_DOUBLE;
+				} else if(!strcmp(optarg,"fixed")) {
+					precision = PRECISION_FIXED;
+				} else if(!strcmp(optarg,"float")) {
+					precision = PRECISION_FLOAT;
+				} else {
+					fprintf(stderr,"mandel: unknown precision %s\n",optarg);
+					exit(1);
+				}
+				break;
+			case 'r':
+				if(!strcmp(optarg,"pixel")) {
+					mode = RENDER_PIXEL;
+				} else if(!strcmp(optarg,"ms")) {
+					mode = RENDER_MARIANI_SILVER;
+				} else {
+					fprintf(stderr,"mandel: unknown render mode %s\n",optarg);
+					exit(1);
+				}
+				break;
 			case 'h':
 				show_help();
 				exit(1);
@@ -97,126 +381,1019 @@ int main( int argc, char *argv[] ) {
 		}
 	}
 
+	if(progressive && mode == RENDER_MARIANI_SILVER) {
+		fprintf(stderr,"mandel: progressive rendering needs -r pixel\n");
+		return 1;
+	}
+
+	if(smooth_counts && (precision == PRECISION_FLOAT || precision == PRECISION_FIXED)) {
+		fprintf(stderr,"mandel: smooth counts are computed in double, -S can't be used with -f float or fixed\n");
+		return 1;
+	}
+
+	if(image_width < 1 || image_height < 1) {
+		fprintf(stderr,"mandel: image size %dx%d is empty\n",image_width,image_height);
+		return 1;
+	}
+
+	if((statsfile || tracefile) && (keyfile || countsin)) {
+		fprintf(stderr,"mandel: -J and -T measure the render of a single image, they can't be used with -b or -i\n");
+		return 1;
+	}
+	if(stream && (progressive || countsout)) {
+		fprintf(stderr,"mandel: -P, -w and -I need the whole image in memory, they can't be used with -L\n");
+		return 1;
+	}
+	/* bands line up with cached tiles (see band_skew), so -c loses nothing by streaming */
+	if(!progressive && !countsout) stream = 1;
+	if(strlen(outfile) >= 4 && !strcasecmp(outfile+strlen(outfile)-4,".rle") && palette != palette_find("gray")) {
+		fprintf(stderr,"mandel: RLE8 bitmaps are grayscale, they can only be used with -C gray\n");
+		return 1;
+	}
+
+	if(!kernel_init(kernel)) {
+		fprintf(stderr,"mandel: kernel %s is not supported on this machine\n",kernel);
+		return 1;
+	}
+
+	// PNG output deflates on no more threads than the render uses.
+	png_set_threads(threads);
+
+	// Colouring saved counts needs no computation at all.
+	if(countsin) {
+		float *counts = counts_load(countsin,&image_width,&image_height,&max);
+		if(!counts) {
+			fprintf(stderr,"mandel: couldn't read iteration counts from %s: %s\n",countsin,strerror(errno));
+			return 1;
+		}
+		printf("mandel: colouring %dx%d counts from %s max=%d outfile=%s\n",image_width,image_height,countsin,max,outfile);
+		struct bitmap *bm = bitmap_create(image_width,image_height);
+		if(!bm) {
+			fprintf(stderr,"mandel: out of memory for a %dx%d image\n",image_width,image_height);
+			free(counts);
+			return 1;
+		}
+		pool_start(threads,pin);
+		color_image(bm,counts,max,palette);
+		pool_stop();
+		ok = bitmap_save(bm,outfile);
+		if(!ok) fprintf(stderr,"mandel: couldn't write to %s: %s\n",outfile,strerror(errno));
+		bitmap_delete(bm);
+		free(counts);
+		return ok ? 0 : 1;
+	}
+
+	// Start the threads once, every render below reuses them.
+	threads = pool_start(threads,pin);
+	if(threads == 0) {
+		fprintf(stderr,"mandel: couldn't start any threads: %s\n",strerror(errno));
+		return 1;
+	}
+	stats_start(threads);
+	if(tracefile) stats_trace(image_width,image_height);
+
+	if(keyfile) {
+		if(!strcmp(outfile,"mandel.bmp")) outfile = "mandel%04d.bmp";
+		ok = render_batch(keyfile,frames,outfile,image_width,image_height,mode,deep,precision,cachedir,periodicity,palette);
+		pool_stop();
+		return ok ? 0 : 1;
+	}
+
+	if(scale < DEEP_ZOOM_SCALE) deep = 1;
+
+	// In deep zoom the kernel works on offsets from the centre, which is only held in the reference orbit.
+	precision = choose_precision(precision,scale,image_width,image_height);
+	if(!set_kernel(deep,precision,xstring,ystring,max)) return 1;
+	if(deep) {
+		xcenter = 0;
+		ycenter = 0;
+	}
+
+	if(cachedir && !open_cache(cachedir,periodicity,deep,precision,mode,scale,xstring,ystring)) return 1;
+
 	// Display the configuration of the image.
-	printf("mandel: x=%lf y=%lf scale=%lf max=%d threads=%d outfile=%s\n",xcenter,ycenter,scale,max,threads, outfile);
+	printf("mandel: x=%s y=%s scale=%lg max=%d threads=%d kernel=%s outfile=%s\n",xstring,ystring,scale,max,threads,kernel_name,outfile);
+
+	// Normally the image is computed in bands, each saved while the next is computed.
+	if(stream) {
+		ok = render_stream(outfile,image_width,image_height,xcenter-scale,xcenter+scale,ycenter-scale,ycenter+scale,max,mode,palette);
+		pool_stop();
+		print_stats(deep,mode,(long)image_width*image_height);
+		if(!save_stats(statsfile,tracefile,xstring,ystring,scale,image_width,image_height,max)) ok = 0;
+		return ok ? 0 : 1;
+	}
 
-	// Create a bitmap of the appropriate size.
+	// Create a bitmap of the appropriate size, and the iteration counts it is coloured from.
 	struct bitmap *bm = bitmap_create(image_width,image_height);
+	float *counts = malloc((size_t)image_width*image_height*sizeof(float));
+	if(!bm || !counts) {
+		fprintf(stderr,"mandel: out of memory for a %dx%d image\n",image_width,image_height);
+		if(bm) bitmap_delete(bm);
+		free(counts);
+		return 1;
+	}
 
 	// Fill it with a dark blue, for debugging
 	bitmap_reset(bm,MAKE_RGBA(0,0,255,0));
 
-	// Compute the Mandelbrot image
-	compute_image(bm,xcenter-scale,xcenter+scale,ycenter-scale,ycenter+scale,max, threads);
+	// Compute the Mandelbrot image, coarsest pass first when progressive.
+	// Each pass only computes the pixels the coarser passes haven't.
+	step = progressive ? PROGRESSIVE_STEP : 1;
+	ok = 1;
+	compute_image(counts,image_width,image_height,xcenter-scale,xcenter+scale,ycenter-scale,ycenter+scale,max, mode, step, 0);
+	while(step > 1) {
+		if(preview) {
+			color_image(bm,counts,max,palette);
+			if(!bitmap_save(bm,outfile)) {
+				fprintf(stderr,"mandel: couldn't write to %s: %s\n",outfile,strerror(errno));
+				ok = 0;
+				break;
+			}
+			printf("mandel: wrote 1/%d resolution preview to %s\n",step*step,outfile);
+			fflush(stdout);
+		}
+		step /= 2;
+		compute_image(counts,image_width,image_height,xcenter-scale,xcenter+scale,ycenter-scale,ycenter+scale,max, mode, step, step*2);
+	}
 
+	if(ok) {
+		color_image(bm,counts,max,palette);
+		pool_stop();
+		print_stats(deep,mode,(long)image_width*image_height);
+		ok = save_stats(statsfile,tracefile,xstring,ystring,scale,image_width,image_height,max);
+	} else {
+		pool_stop();
+	}
 
 	// Save the image in the stated file.
-	if(!bitmap_save(bm,outfile)) {
+	if(ok && !bitmap_save(bm,outfile)) {
 		fprintf(stderr,"mandel: couldn't write to %s: %s\n",outfile,strerror(errno));
-		return 1;
+		ok = 0;
+	}
+
+	if(ok && countsout && !counts_save(countsout,counts,image_width,image_height,max)) {
+		fprintf(stderr,"mandel: couldn't write to %s: %s\n",countsout,strerror(errno));
+		ok = 0;
 	}
 
-	return 0;
+	bitmap_delete(bm);
+	free(counts);
+	return ok ? 0 : 1;
 }
 
-/**
- * Meant to be called by compute_image(), computes only
- * a small partition of the overall image
- */
-void * compute_chunk(void * args) {
-	struct thread_payload * p = (struct thread_payload *)args;
-	int j,i;
+/*
+Find the pixels [i0,i1) x [j0,j1) of a tile.  Tiles start (ox,oy)
+pixels up and left of the image, so those on its edges are clipped.
+*/
+
+static void tile_rect( struct render_job *job, int tile, int *i0, int *j0, int *i1, int *j1 ) {
+	int x = (tile % job->tiles_x) * TILE_SIZE - job->ox;
+	int y = (tile / job->tiles_x) * TILE_SIZE - job->oy;
+
+	*i0 = x > 0 ? x : 0;
+	*j0 = y > 0 ? y : 0;
+	*i1 = x + TILE_SIZE < job->width  ? x + TILE_SIZE : job->width;
+	*j1 = y + TILE_SIZE < job->height ? y + TILE_SIZE : job->height;
+}
+
+/*
+Look up the iteration counts of a tile in the cache, or store them.
+The counts of the tile's pixels are in it, relative to its clipped corner.
+*/
+
+static struct tile_key * tile_key( struct render_job *job, int tile, struct tile_key *key ) {
+	*key = job->key;
+	key->tx += tile % job->tiles_x;
+	key->ty += tile / job->tiles_x;
+	return key;
+}
+
+static int tile_cache_get( struct render_job *job, int tile, int it[TILE_SIZE][TILE_SIZE] ) {
+	struct tile_key key;
+	int i0, j0, i1, j1;
+
+	tile_rect(job,tile,&i0,&j0,&i1,&j1);
+	return cache_get(tile_key(job,tile,&key),(i0+job->ox)%TILE_SIZE,(j0+job->oy)%TILE_SIZE,i1-i0,j1-j0,it[0],TILE_SIZE);
+}
+
+static void tile_cache_put( struct render_job *job, int tile, int it[TILE_SIZE][TILE_SIZE] ) {
+	struct tile_key key;
+	int i0, j0, i1, j1;
+
+	tile_rect(job,tile,&i0,&j0,&i1,&j1);
+	cache_put(tile_key(job,tile,&key),(i0+job->ox)%TILE_SIZE,(j0+job->oy)%TILE_SIZE,i1-i0,j1-j0,it[0],TILE_SIZE);
+}
 
-	for(j = p->chunk_bottom; j < p->chunk_top; j++) {
+/*
+Turn the integer counts of n points into the counts stored for them,
+the same or smooth ones.
+*/
 
-		for(i=0; i  <p->width; i++) {
+static void store_counts( struct render_job *job, const double *x, const double *y, const int *iters, int n, float *out ) {
+	int k;
 
-			// Determine the point in x,y space for that pixel.
-			double x = p->xmin + i*(p->xmax-p->xmin)/p->width;
-			double y = p->ymin + j*(p->ymax-p->ymin)/p->height;
+	if(job->smooth) {
+		kernel_smooth(x,y,iters,n,job->max,out);
+	} else {
+		for(k = 0; k < n; k++) out[k] = iters[k];
+	}
+}
 
-			// Compute the iterations at that point.
-			int iters = iterations_at_point(x,y,p->max);
+/*
+Store the counts of a whole tile.
+*/
+
+static void store_tile( struct render_job *job, int tile, int it[TILE_SIZE][TILE_SIZE] ) {
+	int i, j;
+	int i0, j0, i1, j1;
+	double x[TILE_SIZE];
+	double y[TILE_SIZE];
 
-			// Set the pixel in the bitmap.
-			bitmap_set(p->bm,i,j,iters);
+	tile_rect(job,tile,&i0,&j0,&i1,&j1);
+	for(j = j0; j < j1; j++) {
+		if(job->smooth) {
+			for(i = i0; i < i1; i++) {
+				x[i-i0] = job->xmin + i*(job->xmax-job->xmin)/job->width;
+				y[i-i0] = job->ymin + (job->row0+j)*(job->ymax-job->ymin)/job->image_height;
+			}
 		}
+		store_counts(job,x,y,it[j-j0],i1-i0,&job->counts[(size_t)j*job->width+i0]);
 	}
+}
+
+/*
+Batch rendering of a zoom sequence.  The keyframe file has one
+"x y scale max" line per keyframe; blank lines and lines starting with
+# are ignored.  Frames are spread evenly over the keyframes.  Between two
+keyframes the scale changes geometrically, so the zoom runs at a steady
+speed, and the centre moves so that the next keyframe's centre keeps its
+place in the picture.  Every frame is saved through printf-style pattern,
+as in "frame%04d.bmp".
+*/
+
+struct keyframe {
+	double x;
+	double y;
+	double scale;
+	int max;
+};
+
+/* A frame being saved by its own thread while the next is computed */
+struct frame_writer {
+	pthread_t tid;
+	struct bitmap *bm;
+	char path[4096];
+	int running;
+	int ok;
+	int err;
+};
+
+static int load_keyframes( const char *path, struct keyframe **keys ) {
+	FILE *file;
+	char line[1024];
+	int n = 0, size = 16;
+	struct keyframe k;
+
+	file = fopen(path,"r");
+	if(!file) return -1;
+
+	*keys = malloc(size*sizeof(**keys));
+	while(*keys && fgets(line,sizeof(line),file)) {
+		char *s = line + strspn(line," \t");
+		if(*s == '#' || *s == '\n' || *s == 0) continue;
+		if(sscanf(s,"%lf %lf %lf %d",&k.x,&k.y,&k.scale,&k.max) != 4 || k.scale <= 0 || k.max < 1) {
+			fprintf(stderr,"mandel: bad keyframe in %s: %s",path,line);
+			n = -1;
+			break;
+		}
+		if(n == size) {
+			size *= 2;
+			*keys = realloc(*keys,size*sizeof(**keys));
+			if(!*keys) break;
+		}
+		(*keys)[n++] = k;
+	}
+
+	fclose(file);
+	if(!*keys) n = -1;
+	return n;
+}
+
+/* The frame at position t, counted in keyframes, along the sequence. */
+static struct keyframe interpolate( const struct keyframe *keys, int nkeys, double t ) {
+	int k = (int)t;
+	double u, f;
+	struct keyframe a, b, r;
+
+	if(k >= nkeys-1) return keys[nkeys-1];
+	a = keys[k];
+	b = keys[k+1];
+	u = t - k;
+
+	r.scale = a.scale * pow(b.scale/a.scale,u);
+	f = a.scale != b.scale ? (a.scale - r.scale) / (a.scale - b.scale) : u;
+	r.x = a.x + f*(b.x - a.x);
+	r.y = a.y + f*(b.y - a.y);
+	r.max = (int)(a.max + u*(b.max - a.max) + 0.5);
+	return r;
+}
+
+/* Does pattern hold exactly one integer conversion, for the frame number? */
+static int valid_pattern( const char *pattern ) {
+	const char *p = strchr(pattern,'%');
+
+	if(!p) return 0;
+	p += 1 + strspn(p+1,"0123456789");
+	return *p == 'd' && !strchr(p,'%');
+}
+
+static void * write_frame( void *arg ) {
+	struct frame_writer *w = arg;
+
+	w->ok = bitmap_save(w->bm,w->path);
+	w->err = errno;
 	return NULL;
 }
 
+/* Wait for a writer to finish, reporting whether its frame was saved. */
+static int join_writer( struct frame_writer *w ) {
+	if(!w->running) return 1;
+
+	pthread_join(w->tid,NULL);
+	w->running = 0;
+	if(!w->ok) {
+		fprintf(stderr,"mandel: couldn't write to %s: %s\n",w->path,strerror(w->err));
+	}
+	return w->ok;
+}
+
 /*
-Compute an entire Mandelbrot image, writing each point to the given bitmap.
+Render the sequence.  Two bitmaps take turns: while one frame is being
+computed, the previous one is written out from the other.
+*/
+
+int render_batch( const char *keyfile, int frames, const char *pattern, int width, int height, int mode, int deep, int precision, const char *cachedir, int periodicity, palette_func palette ) {
+	struct keyframe *keys;
+	float *counts;
+	struct frame_writer writers[2];
+	int nkeys, f, ok = 1;
+
+	if(!valid_pattern(pattern)) {
+		fprintf(stderr,"mandel: batch output %s needs one frame number format, such as frame%%04d.bmp\n",pattern);
+		return 0;
+	}
+
+	nkeys = load_keyframes(keyfile,&keys);
+	if(nkeys < 0) {
+		fprintf(stderr,"mandel: couldn't read keyframes from %s: %s\n",keyfile,strerror(errno));
+		return 0;
+	}
+	if(nkeys == 0 || frames < 1) {
+		fprintf(stderr,"mandel: nothing to render from %s\n",keyfile);
+		free(keys);
+		return 0;
+	}
+
+	writers[0].bm = bitmap_create(width,height);
+	writers[1].bm = bitmap_create(width,height);
+	writers[0].running = writers[1].running = 0;
+	counts = malloc((size_t)width*height*sizeof(float));
+	if(!writers[0].bm || !writers[1].bm || !counts) {
+		fprintf(stderr,"mandel: out of memory for %dx%d frames\n",width,height);
+		exit(1);
+	}
+
+	printf("mandel: batch of %d frames through %d keyframes threads=%d outfile=%s\n",frames,nkeys,pool_threads(),pattern);
+
+	for(f = 0; f < frames && ok; f++) {
+		struct frame_writer *w = &writers[f%2];
+		double t = frames > 1 ? (double)f*(nkeys-1)/(frames-1) : 0;
+		struct keyframe k = interpolate(keys,nkeys,t);
+		int frame_deep = deep || k.scale < DEEP_ZOOM_SCALE;
+		double xcenter = k.x, ycenter = k.y;
+		char xs[64], ys[64];
+
+		snprintf(xs,sizeof(xs),"%.17g",k.x);
+		snprintf(ys,sizeof(ys),"%.17g",k.y);
+		int frame_precision = choose_precision(precision,k.scale,width,height);
+		if(!set_kernel(frame_deep,frame_precision,xs,ys,k.max)) {
+			ok = 0;
+			break;
+		}
+		if(frame_deep) {
+			xcenter = 0;
+			ycenter = 0;
+		}
+		if(cachedir && !open_cache(cachedir,periodicity,frame_deep,frame_precision,mode,k.scale,xs,ys)) {
+			ok = 0;
+			break;
+		}
+
+		/* this bitmap was last written out two frames ago */
+		ok = join_writer(w);
+		if(!ok) break;
+
+		compute_image(counts,width,height,xcenter-k.scale,xcenter+k.scale,ycenter-k.scale,ycenter+k.scale,k.max,mode,1,0);
+		color_image(w->bm,counts,k.max,palette);
+
+		snprintf(w->path,sizeof(w->path),pattern,f);
+		printf("mandel: frame %d x=%s y=%s scale=%lg max=%d kernel=%s -> %s\n",f,xs,ys,k.scale,k.max,kernel_name,w->path);
+		fflush(stdout);
+
+		if(pthread_create(&w->tid,NULL,write_frame,w) == 0) {
+			w->running = 1;
+		} else {
+			write_frame(w);
+			if(!w->ok) {
+				fprintf(stderr,"mandel: couldn't write to %s: %s\n",w->path,strerror(w->err));
+				ok = 0;
+			}
+		}
+	}
+
+	for(f = 0; f < 2; f++) {
+		if(!join_writer(&writers[f])) ok = 0;
+		bitmap_delete(writers[f].bm);
+	}
+	free(counts);
+	free(keys);
+	return ok;
+}
+
+/*
+Band rendering.  The image is computed a band of rows at a time by the
+thread pool, and each finished band goes to an encoder thread that
+colours it and writes it to the file, in order, while the pool computes
+the next band.  Two sets of band buffers take turns, so memory use
+depends on the width and the number of threads but not on the height.
+Bands are several tiles high, tall enough to give every thread a good
+number of tiles to balance.  With the tile cache, band edges are moved
+onto the edges of the cache's tiles so no tile is split between bands,
+and a band render shares every tile with one done in memory.  A PNG is
+written top row first, so then the bands are computed from the top of
+the image down.
+*/
+
+struct band_writer {
+	pthread_t tid;
+	struct bitmap_stream *out;
+	const int *table;
+	int max;
+	float *counts;
+	int *rgba;
+	long n;
+	int rows;
+	int running;
+	int ok;
+};
+
+static void * write_band( void *arg ) {
+	struct band_writer *w = arg;
+
+	palette_map(w->table,w->max,w->counts,w->rgba,w->n);
+	w->ok = bitmap_stream_write(w->out,w->rgba,w->rows);
+	return NULL;
+}
+
+static int join_band( struct band_writer *w ) {
+	if(w->running) {
+		pthread_join(w->tid,NULL);
+		w->running = 0;
+	}
+	return w->ok;
+}
+
+int render_stream( const char *outfile, int width, int height, double xmin, double xmax, double ymin, double ymax, int max, int mode, palette_func palette ) {
+	struct bitmap_stream *out;
+	struct band_writer writers[2];
+	int *table;
+	int band = 2*TILE_SIZE;
+	int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+	int nbands, skew, most, topdown = 0, k, b, ok = 1;
+
+	/* band edges fall on the edges of cached tiles, so the first band may be short */
+	skew = band_skew(height,ymin);
+	while((long)tiles_x*(band/TILE_SIZE) < 16L*pool_threads() && band < height + skew) band *= 2;
+	most = band < height ? band : height;
+
+	table = palette_table(palette,max);
+	for(b = 0; b < 2; b++) {
+		writers[b].counts = malloc((size_t)width*most*sizeof(float));
+		writers[b].rgba = malloc((size_t)width*most*sizeof(int));
+		writers[b].running = 0;
+		writers[b].ok = 1;
+		if(!table || !writers[b].counts || !writers[b].rgba) {
+			fprintf(stderr,"mandel: out of memory for bands of %dx%d pixels\n",width,most);
+			exit(1);
+		}
+	}
+
+	out = bitmap_stream_open(outfile,width,height);
+	if(!out) {
+		fprintf(stderr,"mandel: couldn't write to %s: %s\n",outfile,strerror(errno));
+		ok = 0;
+	} else {
+		topdown = bitmap_stream_topdown(out);
+	}
+
+	nbands = (height + skew + band - 1) / band;
+	for(k = 0, b = 0; k < nbands && ok; k++, b ^= 1) {
+		struct band_writer *w = &writers[b];
+		int start = (topdown ? nbands-1-k : k) * band - skew;
+		int row = start > 0 ? start : 0;
+		int rows = (start + band < height ? start + band : height) - row;
+
+		/* these buffers were being written two bands ago */
+		ok = join_band(w);
+		if(!ok) break;
+
+		compute_band(w->counts,width,height,row,rows,xmin,xmax,ymin,ymax,max,mode);
+
+		/* bands must reach the file in order */
+		ok = join_band(&writers[b^1]);
+		if(!ok) break;
+
+		w->out = out;
+		w->table = table;
+		w->max = max;
+		w->n = (long)width*rows;
+		w->rows = rows;
+		if(pthread_create(&w->tid,NULL,write_band,w) == 0) {
+			w->running = 1;
+		} else {
+			write_band(w);
+		}
+	}
+
+	for(b = 0; b < 2; b++) {
+		if(!join_band(&writers[b])) ok = 0;
+		free(writers[b].counts);
+		free(writers[b].rgba);
+	}
+	free(table);
+
+	if(out && !bitmap_stream_close(out)) ok = 0;
+	if(out && !ok) fprintf(stderr,"mandel: couldn't write to %s: %s\n",outfile,strerror(errno));
+	return ok;
+}
+
+/*
+Compute one tile of the image, clipped to the image edges.
+Only pixels on the job's step grid are computed, each one painted over
+the step x step block below and right of it so a coarse pass still
+covers the image.  Pixels on the coarse grid were done by an earlier
+pass and are left alone.
+*/
+
+void compute_tile( struct render_job *job, int tile ) {
+	int i, j, k, n, bi, bj;
+	int step = job->step;
+	int i0, j0, i1, j1;
+
+	double x[TILE_SIZE];
+	double y[TILE_SIZE];
+	int col[TILE_SIZE];
+	int iters[TILE_SIZE];
+	float counts[TILE_SIZE];
+	int it[TILE_SIZE][TILE_SIZE];
+
+	tile_rect(job,tile,&i0,&j0,&i1,&j1);
+
+	for(j = j0; j < j1; j += step) {
+		int coarse_row = job->coarse && j % job->coarse == 0;
+
+		// Pick the columns of this row still to compute.
+		n = 0;
+		for(i = i0; i < i1; i += step) {
+			if(coarse_row && i % job->coarse == 0) continue;
+			x[n] = job->xmin + i*(job->xmax-job->xmin)/job->width;
+			y[n] = job->ymin + (job->row0+j)*(job->ymax-job->ymin)/job->image_height;
+			col[n] = i;
+			n++;
+		}
+		if(n == 0) continue;
+
+		// Compute the iterations for the whole row of the tile at once.
+		kernel_points(x,y,n,job->max,iters);
+		stats_points(iters,n);
+
+		if(job->cache) {
+			memcpy(it[j-j0],iters,n*sizeof(int));
+		}
+
+		// Store the counts of the pixels.
+		store_counts(job,x,y,iters,n,counts);
+		for(k = 0; k < n; k++) {
+			for(bj = j; bj < j + step && bj < j1; bj++) {
+				for(bi = col[k]; bi < col[k] + step && bi < i1; bi++) {
+					job->counts[(size_t)bj*job->width+bi] = counts[k];
+				}
+			}
+		}
+	}
+
+	if(job->cache) tile_cache_put(job,tile,it);
+}
+
+/*
+Mariani-Silver subdivision.  The iteration counts of a tile are kept in
+a TILE_SIZE x TILE_SIZE buffer where -1 marks a pixel not computed yet.
+A rectangle has its border computed; if every border pixel has the same
+count, the Mandelbrot set being connected means the inside has that count
+too and is filled without iterating.  Otherwise the rectangle is split
+in two across its longer side, the halves sharing the split line, until
+it is small enough to just compute.
+*/
+
+#define MS_MIN_SIZE 4
+
+/* Most pixels a single ms_rect() step asks for: four rows or columns of a tile */
+#define MS_BATCH (4*TILE_SIZE)
+
+struct ms_tile {
+	struct render_job *job;
+	int i0;
+	int j0;
+	int it[TILE_SIZE][TILE_SIZE];
+
+	/* pixels queued for the next kernel call */
+	int n;
+	double x[MS_BATCH];
+	double y[MS_BATCH];
+	int iters[MS_BATCH];
+	int *dest[MS_BATCH];
+};
+
+/* Queue pixel (i,j), tile relative, unless it is already known. */
+static void ms_want( struct ms_tile *t, int i, int j ) {
+	struct render_job *job = t->job;
+
+	if(t->it[j][i] >= 0) return;
+
+	t->x[t->n] = job->xmin + (t->i0+i)*(job->xmax-job->xmin)/job->width;
+	t->y[t->n] = job->ymin + (job->row0+t->j0+j)*(job->ymax-job->ymin)/job->image_height;
+	t->dest[t->n] = &t->it[j][i];
+	t->n++;
+}
+
+/* Compute all queued pixels in one kernel call. */
+static void ms_flush( struct ms_tile *t ) {
+	int k;
+
+	if(t->n == 0) return;
+
+	kernel_points(t->x,t->y,t->n,t->job->max,t->iters);
+	stats_points(t->iters,t->n);
+	for(k = 0; k < t->n; k++) {
+		*t->dest[k] = t->iters[k];
+	}
+	t->n = 0;
+}
+
+/* Fill the rectangle with corners (i0,j0) and (i1,j1) inclusive, tile relative. */
+static void ms_rect( struct ms_tile *t, int i0, int j0, int i1, int j1 ) {
+	int i, j, value;
+
+	if(i1 - i0 < MS_MIN_SIZE || j1 - j0 < MS_MIN_SIZE) {
+		for(j = j0; j <= j1; j++) {
+			for(i = i0; i <= i1; i++) ms_want(t,i,j);
+		}
+		ms_flush(t);
+		return;
+	}
+
+	/* queue each side in order, neighbouring lanes cost about the same */
+	for(i = i0; i <= i1; i++) ms_want(t,i,j0);
+	for(i = i0; i <= i1; i++) ms_want(t,i,j1);
+	for(j = j0+1; j < j1; j++) ms_want(t,i0,j);
+	for(j = j0+1; j < j1; j++) ms_want(t,i1,j);
+	ms_flush(t);
+
+	value = t->it[j0][i0];
+	for(i = i0; i <= i1; i++) {
+		if(t->it[j0][i] != value || t->it[j1][i] != value) goto split;
+	}
+	for(j = j0+1; j < j1; j++) {
+		if(t->it[j][i0] != value || t->it[j][i1] != value) goto split;
+	}
+
+	for(j = j0+1; j < j1; j++) {
+		for(i = i0+1; i < i1; i++) {
+			t->it[j][i] = value;
+		}
+	}
+	__atomic_add_fetch(&ms_filled,(long)(i1-i0-1)*(j1-j0-1),__ATOMIC_RELAXED);
+	return;
+
+split:
+	if(i1 - i0 >= j1 - j0) {
+		int mid = (i0 + i1) / 2;
+		ms_rect(t,i0,j0,mid,j1);
+		ms_rect(t,mid,j0,i1,j1);
+	} else {
+		int mid = (j0 + j1) / 2;
+		ms_rect(t,i0,j0,i1,mid);
+		ms_rect(t,i0,mid,i1,j1);
+	}
+}
+
+void compute_tile_ms( struct render_job *job, int tile ) {
+	struct ms_tile t;
+	int i1, j1;
+
+	t.job = job;
+	tile_rect(job,tile,&t.i0,&t.j0,&i1,&j1);
+	t.n = 0;
+	memset(t.it,-1,sizeof(t.it));
+
+	ms_rect(&t,0,0,i1-t.i0-1,j1-t.j0-1);
+
+	if(job->cache) tile_cache_put(job,tile,t.it);
+	store_tile(job,tile,t.it);
+}
+
+/*
+Take the next tile for thread "id": from the front of its own queue, or
+failing that by stealing the back half of another thread's queue.
+Returns -1 once no queue has any work left.
+*/
+
+static int next_tile( struct render_job *job, int id ) {
+	struct tile_queue *own = &job->queues[id];
+	int tile = -1;
+	int v;
+
+	pthread_mutex_lock(&own->lock);
+	if(own->head < own->tail) {
+		tile = own->head++;
+	}
+	pthread_mutex_unlock(&own->lock);
+
+	if(tile >= 0) return tile;
+
+	for(v = 1; v < job->threads; v++) {
+		struct tile_queue *victim = &job->queues[(id + v) % job->threads];
+		int head, tail;
+
+		pthread_mutex_lock(&victim->lock);
+		tail = victim->tail;
+		head = tail - (tail - victim->head + 1) / 2;
+		if(head < tail) victim->tail = head;
+		pthread_mutex_unlock(&victim->lock);
+
+		if(head < tail) {
+			/* keep the first stolen tile, queue the rest as our own */
+			pthread_mutex_lock(&own->lock);
+			own->head = head + 1;
+			own->tail = tail;
+			pthread_mutex_unlock(&own->lock);
+			return head;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Run by every pool thread for compute_image(), computes tiles
+ * until every queue is drained.
+ */
+void compute_chunk(void * args, int id) {
+	struct render_job * job = (struct render_job *)args;
+	int tile;
+
+	while((tile = next_tile(job, id)) >= 0) {
+		double start = stats_now();
+		int i0, j0, i1, j1;
+		if(job->tiles) tile = job->tiles[tile];
+		if(job->mode == RENDER_MARIANI_SILVER) {
+			compute_tile_ms(job, tile);
+		} else {
+			compute_tile(job, tile);
+		}
+		tile_rect(job, tile, &i0, &j0, &i1, &j1);
+		stats_tile(id, i0, job->row0 + j0, start, stats_now());
+	}
+	stats_finish(id);
+}
+
+static long long floor_div( long long a, long long b ) {
+	return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+/*
+Line the tiles of a job up with the cache's grid of tiles, which is
+anchored at coordinate 0.  Returns 0 if the image is too far from the
+origin, in pixels, to place on the grid.
+*/
+
+static int cache_align( struct render_job *job ) {
+	/* from the scale, not xmax-xmin, whose rounding moves with the centre */
+	double dx = 2*cache_scale/job->width;
+	double dy = 2*cache_scale/job->image_height;
+	double cx = job->xmin/dx;
+	double cy = job->ymin/dy;
+	long long sx, sy, px, py, gx, gy, phase_y;
+
+	if(fabs(cx) > 1e14 || fabs(cy) > 1e14) return 0;
+
+	/* position of the image's first pixel in 1/CACHE_PHASES pixel steps */
+	sx = llround(cx*CACHE_PHASES);
+	sy = llround(cy*CACHE_PHASES);
+	px = floor_div(sx,CACHE_PHASES);
+	/* a band is placed from the image's first row, so every band agrees on the phase */
+	py = floor_div(sy,CACHE_PHASES);
+	phase_y = sy - py*CACHE_PHASES;
+	py += job->row0;
+	gx = floor_div(px,TILE_SIZE);
+	gy = floor_div(py,TILE_SIZE);
+
+	memset(&job->key,0,sizeof(job->key));
+	job->key.tx = gx;
+	job->key.ty = gy;
+	job->key.phase_x = sx - px*CACHE_PHASES;
+	job->key.phase_y = phase_y;
+	job->key.dx = dx;
+	job->key.dy = dy;
+	job->key.size = TILE_SIZE;
+	job->key.max = job->max;
+	job->ox = px - gx*TILE_SIZE;
+	job->oy = py - gy*TILE_SIZE;
+	return 1;
+}
+
+/*
+How many rows the cache's grid of tiles starts above the first row of
+an image, 0 when the cache isn't used.  Bands that start on the grid
+never split a tile between them, so their tiles are cached whole.
+*/
+
+int band_skew( int height, double ymin ) {
+	double cy = ymin/(2*cache_scale/height);
+	long long py;
+
+	if(!cache_enabled() || fabs(cy) > 1e14) return 0;
+
+	py = floor_div(llround(cy*CACHE_PHASES),CACHE_PHASES);
+	return py - floor_div(py,TILE_SIZE)*TILE_SIZE;
+}
+
+/*
+Compute rows row0 ... row0+rows-1 of a width x height image, writing the
+count of each point to "counts", which holds just those rows.
 Scale the image to the range (xmin-xmax,ymin-ymax), limiting iterations to "max"
+Only every "step"th pixel is computed, skipping those on the "coarse" grid
+already computed by an earlier pass (0 when there was none).
+Full resolution passes take what tiles they can from the tile cache and
+only hand the rest to the threads.
+The work is done by the threads of the pool, see pool.h.
+The time taken goes into the statistics, see stats.h.
 */
 
-void compute_image( struct bitmap *bm, double xmin, double xmax, double ymin, double ymax, int max , int threads) {
-	int chunk_size, i;
-	int width = bitmap_width(bm);
-	int height = bitmap_height(bm);
+static void compute_rows( float *counts, int width, int height, int row0, int rows, double xmin, double xmax, double ymin, double ymax, int max , int mode, int step, int coarse) {
+	int i, ntiles, threads;
+	struct render_job job;
+	double start = stats_now(), joined;
+
+	threads = pool_threads();
+	if(threads < 1) threads = 1;
+
+	job.counts = counts;
+	job.xmin = xmin;
+	job.xmax = xmax;
+	job.ymin = ymin;
+	job.ymax = ymax;
+	job.max = max;
+	job.width = width;
+	job.height = rows;
+	job.row0 = row0;
+	job.image_height = height;
+	job.threads = threads;
+	job.mode = mode;
+	job.step = step;
+	job.coarse = coarse;
+	/* smoothing iterates absolute coordinates, perturbation works on offsets */
+	job.smooth = smooth_counts && kernel_points != perturb_points;
+	job.cache = cache_enabled() && step == 1 && coarse == 0;
+	job.ox = 0;
+	job.oy = 0;
+	job.tiles = NULL;
 
-	/* Create an array of thread args, populate them on each iteration.*/
-	pthread_t tid[threads];
-	struct thread_payload args[threads];
-	chunk_size = height / threads;
+	if(job.cache && !cache_align(&job)) job.cache = 0;
+
+	job.tiles_x = (job.width + job.ox + TILE_SIZE - 1) / TILE_SIZE;
+	job.tiles_y = (job.height + job.oy + TILE_SIZE - 1) / TILE_SIZE;
+	ntiles = job.tiles_x * job.tiles_y;
+
+	if(job.cache) {
+		int tile, n = 0;
+		int it[TILE_SIZE][TILE_SIZE];
+
+		job.tiles = malloc(ntiles * sizeof(int));
+		if(!job.tiles) {
+			fprintf(stderr,"mandel: out of memory\n");
+			exit(1);
+		}
+		for(tile = 0; tile < ntiles; tile++) {
+			if(tile_cache_get(&job,tile,it)) {
+				store_tile(&job,tile,it);
+			} else {
+				job.tiles[n++] = tile;
+			}
+		}
+		ntiles = n;
+	}
+
+	/* Deal each thread an equal run of tiles to start with. */
+	struct tile_queue *queues = aligned_alloc(64, threads * sizeof(*queues));
+	if(!queues) {
+		fprintf(stderr,"mandel: out of memory\n");
+		exit(1);
+	}
+	job.queues = queues;
 	for (i = 0; i < threads; i++) {
-		args[i].bm = bm;
-		args[i].xmin = xmin;
-		args[i].xmax = xmax;
-		args[i].ymin = ymin;
-		args[i].ymax = ymax;
-		args[i].max = max;
-		args[i].chunk_top = ((i+1) * chunk_size);
-		args[i].chunk_bottom = i * chunk_size;
-		args[i].width = width;
-		args[i].height = height;
-
-		/* spawn thread */
-		pthread_create(&tid[i], NULL, compute_chunk, &args[i]);
-	}
-
-	/* close threads */
+		pthread_mutex_init(&queues[i].lock, NULL);
+		queues[i].head = (long)ntiles * i / threads;
+		queues[i].tail = (long)ntiles * (i+1) / threads;
+	}
+
+	pool_run(compute_chunk, &job);
+	joined = stats_now();
+
 	for (i = 0; i < threads; i++) {
-		pthread_join(tid[i], NULL);
+		pthread_mutex_destroy(&queues[i].lock);
 	}
+
+	free(queues);
+	free(job.tiles);
+
+	/* only a full resolution pass finishes its pixels */
+	stats_compute(start, joined, step == 1 ? (long)width*rows : 0);
 }
 
 /*
-Return the number of iterations at point x, y
-in the Mandelbrot space, up to a maximum of max.
+Compute an entire Mandelbrot image, writing the count of each point to "counts".
 */
 
-int iterations_at_point( double x, double y, int max ) {
-	double x0 = x;
-	double y0 = y;
+void compute_image( float *counts, int width, int height, double xmin, double xmax, double ymin, double ymax, int max , int mode, int step, int coarse) {
+	compute_rows(counts,width,height,0,height,xmin,xmax,ymin,ymax,max,mode,step,coarse);
+}
 
-	int iter = 0;
+/*
+Compute the band of rows row0 ... row0+rows-1 of an image, at full resolution.
+*/
 
-	while( (x*x + y*y <= 4) && iter < max ) {
+void compute_band( float *counts, int width, int height, int row0, int rows, double xmin, double xmax, double ymin, double ymax, int max , int mode) {
+	compute_rows(counts,width,height,row0,rows,xmin,xmax,ymin,ymax,max,mode,1,0);
+}
 
-		double xt = x*x - y*y + x0;
-		double yt = 2*x*y + y0;
+/*
+Colouring runs on the pool too, each thread taking an equal run of pixels.
+*/
 
-		x = xt;
-		y = yt;
+struct color_job {
+	const int *table;
+	int max;
+	const float *counts;
+	int *rgba;
+	long n;
+	int threads;
+};
 
-		iter++;
-	}
+static void color_chunk( void *args, int id ) {
+	struct color_job *job = (struct color_job *)args;
+	long start = job->n * id / job->threads;
+	long end = job->n * (id+1) / job->threads;
 
-	return iteration_to_color(iter,max);
+	palette_map(job->table,job->max,job->counts+start,job->rgba+start,end-start);
 }
 
 /*
-Convert a iteration number to an RGBA color.
-Here, we just scale to gray with a maximum of imax.
-Modify this function to make more interesting colors.
+Colour the iteration counts of an image into the bitmap, with the given palette.
 */
 
-int iteration_to_color( int i, int max ) {
-	int gray = 255*i/max;
-	return MAKE_RGBA(gray,gray,gray,0);
+void color_image( struct bitmap *bm, const float *counts, int max, palette_func palette ) {
+	color_counts(bitmap_data(bm),counts,(long)bitmap_width(bm)*bitmap_height(bm),max,palette);
 }
 
+/*
+Colour n iteration counts into the RGBA pixels of rgba.
+*/
 
+void color_counts( int *rgba, const float *counts, long n, int max, palette_func palette ) {
+	struct color_job job;
 
+	job.table = palette_table(palette,max);
+	if(!job.table) {
+		fprintf(stderr,"mandel: out of memory\n");
+		exit(1);
+	}
+	job.max = max;
+	job.counts = counts;
+	job.rgba = rgba;
+	job.n = n;
+	job.threads = pool_threads() > 0 ? pool_threads() : 1;
 
+	pool_run(color_chunk,&job);
+	free((int *)job.table);
+}
@@ -0,0 +1,112 @@
+
+#include "palette.h"
+#include "bitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The original colouring: gray scaled to white at max. */
+static int palette_gray( int i, int max ) {
+	int gray = 255*i/max;
+	return MAKE_RGBA(gray,gray,gray,0);
+}
+
+/* Black through red and yellow to white, points in the set black. */
+static int palette_fire( int i, int max ) {
+	int t, r, g, b;
+
+	if(i >= max) return MAKE_RGBA(0,0,0,0);
+
+	t = 3*255*i/max;
+	r = t < 255 ? t : 255;
+	g = t < 255 ? 0 : t < 510 ? t - 255 : 255;
+	b = t < 510 ? 0 : t - 510;
+	return MAKE_RGBA(r,g,b,0);
+}
+
+/*
+A hue wheel repeating every 64 counts, so detail shows at any depth,
+points in the set black.
+*/
+static int palette_rainbow( int i, int max ) {
+	int h, f, r, g, b;
+
+	if(i >= max) return MAKE_RGBA(0,0,0,0);
+
+	h = (i % 64) * 6;
+	f = (h % 64) * 255 / 63;
+	switch(h / 64) {
+		case 0:  r = 255;     g = f;       b = 0;       break;
+		case 1:  r = 255 - f; g = 255;     b = 0;       break;
+		case 2:  r = 0;       g = 255;     b = f;       break;
+		case 3:  r = 0;       g = 255 - f; b = 255;     break;
+		case 4:  r = f;       g = 0;       b = 255;     break;
+		default: r = 255;     g = 0;       b = 255 - f; break;
+	}
+	return MAKE_RGBA(r,g,b,0);
+}
+
+static struct {
+	const char *name;
+	palette_func palette;
+} palettes[] = {
+	{ "gray",    palette_gray },
+	{ "fire",    palette_fire },
+	{ "rainbow", palette_rainbow },
+};
+
+#define NPALETTES (sizeof(palettes)/sizeof(palettes[0]))
+
+palette_func palette_find( const char *name ) {
+	unsigned i;
+	for(i = 0; i < NPALETTES; i++) {
+		if(!strcmp(name,palettes[i].name)) return palettes[i].palette;
+	}
+	return 0;
+}
+
+const char * palette_names() {
+	return "gray, fire or rainbow";
+}
+
+/* Colours of counts 0 ... max, with one spare entry so blending can look one past max. */
+int * palette_table( palette_func palette, int max ) {
+	int *table = malloc((max+2)*sizeof(int));
+	int i;
+
+	if(!table) return 0;
+	for(i = 0; i <= max; i++) {
+		table[i] = palette(i,max);
+	}
+	table[max+1] = table[max];
+	return table;
+}
+
+static int blend( int a, int b, float f ) {
+	int r = GET_RED(a)   + (int)((GET_RED(b)   - GET_RED(a))   * f);
+	int g = GET_GREEN(a) + (int)((GET_GREEN(b) - GET_GREEN(a)) * f);
+	int c = GET_BLUE(a)  + (int)((GET_BLUE(b)  - GET_BLUE(a))  * f);
+	return MAKE_RGBA(r,g,c,GET_ALPHA(a));
+}
+
+/* Colour n counts, which lie between 0 and max. */
+void palette_map( const int *table, int max, const float *counts, int *rgba, long n ) {
+	long k;
+
+	for(k = 0; k < n; k++) {
+		float c = counts[k];
+		int i;
+		float f;
+
+		if(!(c > 0)) c = 0;
+		if(c > max) c = max;
+		i = (int)c;
+		f = c - i;
+
+		if(f == 0) {
+			rgba[k] = table[i];
+		} else {
+			rgba[k] = blend(table[i],table[i+1],f);
+		}
+	}
+}
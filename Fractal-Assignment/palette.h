@@ -0,0 +1,19 @@
+
+#ifndef PALETTE_H
+#define PALETTE_H
+
+/*
+Colouring of iteration counts.  A palette gives the RGBA colour of the
+integer count i out of max.  Images are coloured through a table of the
+max+1 colours of a palette; fractional (smooth) counts blend the two
+nearest entries.
+*/
+
+typedef int (*palette_func)( int i, int max );
+
+palette_func palette_find( const char *name );
+const char * palette_names();
+int *        palette_table( palette_func palette, int max );
+void         palette_map( const int *table, int max, const float *counts, int *rgba, long n );
+
+#endif
@@ -0,0 +1,291 @@
+
+#include "perturb.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+Below a scale of about 1e-13 neighbouring pixels are no longer distinct
+doubles, so the plain kernels render blocks.  Perturbation computes one
+reference orbit Z at the image centre C in high precision, and every
+pixel c = C + dc as a small offset z = Z + dz from it, in double:
+
+	dz' = 2*Z*dz + dz*dz + dc
+
+dz and dc are tiny but doubles have plenty of exponent range, so only
+the reference needs the extra precision.
+
+The reference can be a poor match for a pixel: where |Z + dz| becomes
+smaller than |dz| the offset no longer carries the pixel's digits and
+the result is a "glitch".  Such pixels are rebased: dz takes the full
+value Z + dz and iteration continues against the reference from its
+start, Z = 0.  The same happens when the reference escapes before the
+pixel does.  This removes glitches without secondary reference orbits.
+*/
+
+/*
+The reference is computed in fixed point: MP_LIMBS 64 bit limbs, two's
+complement, least significant first, with the top limb holding the
+integer part.  That leaves 448 bits of fraction, enough for zooms to
+around 1e-120.
+*/
+
+#define MP_LIMBS 8
+
+struct mp {
+	uint64_t l[MP_LIMBS];
+};
+
+static int mp_negative( const struct mp *a ) {
+	return (int64_t)a->l[MP_LIMBS-1] < 0;
+}
+
+static void mp_neg( struct mp *a ) {
+	unsigned __int128 carry = 1;
+	int k;
+	for(k=0;k<MP_LIMBS;k++) {
+		carry += (uint64_t)~a->l[k];
+		a->l[k] = (uint64_t)carry;
+		carry >>= 64;
+	}
+}
+
+static void mp_add( struct mp *r, const struct mp *a, const struct mp *b ) {
+	unsigned __int128 carry = 0;
+	int k;
+	for(k=0;k<MP_LIMBS;k++) {
+		carry += (unsigned __int128)a->l[k] + b->l[k];
+		r->l[k] = (uint64_t)carry;
+		carry >>= 64;
+	}
+}
+
+static void mp_sub( struct mp *r, const struct mp *a, const struct mp *b ) {
+	struct mp nb = *b;
+	mp_neg(&nb);
+	mp_add(r,a,&nb);
+}
+
+/* r = a*b, truncated to the fixed point format. */
+static void mp_mul( struct mp *r, const struct mp *a, const struct mp *b ) {
+	uint64_t prod[2*MP_LIMBS];
+	struct mp ua = *a, ub = *b;
+	int neg = 0;
+	int i, j;
+
+	if(mp_negative(&ua)) { mp_neg(&ua); neg = !neg; }
+	if(mp_negative(&ub)) { mp_neg(&ub); neg = !neg; }
+
+	memset(prod,0,sizeof(prod));
+	for(i=0;i<MP_LIMBS;i++) {
+		unsigned __int128 carry = 0;
+		for(j=0;j<MP_LIMBS;j++) {
+			carry += (unsigned __int128)ua.l[i]*ub.l[j] + prod[i+j];
+			prod[i+j] = (uint64_t)carry;
+			carry >>= 64;
+		}
+		prod[i+MP_LIMBS] = (uint64_t)carry;
+	}
+
+	/* drop the extra MP_LIMBS-1 fraction limbs */
+	memcpy(r->l,&prod[MP_LIMBS-1],sizeof(r->l));
+	if(neg) mp_neg(r);
+}
+
+/* Multiply or divide the magnitude in a by a small factor. */
+static void mp_mul_small( struct mp *a, uint64_t f ) {
+	unsigned __int128 carry = 0;
+	int k;
+	for(k=0;k<MP_LIMBS;k++) {
+		carry += (unsigned __int128)a->l[k]*f;
+		a->l[k] = (uint64_t)carry;
+		carry >>= 64;
+	}
+}
+
+static void mp_div_small( struct mp *a, uint64_t d ) {
+	unsigned __int128 rem = 0;
+	int k;
+	for(k=MP_LIMBS-1;k>=0;k--) {
+		rem = (rem << 64) | a->l[k];
+		a->l[k] = (uint64_t)(rem / d);
+		rem %= d;
+	}
+}
+
+static double mp_to_double( const struct mp *a ) {
+	struct mp u = *a;
+	double v = 0, unit = 1;
+	int neg = mp_negative(&u);
+	int k;
+
+	if(neg) mp_neg(&u);
+
+	/* the top three limbs already hold more than double precision */
+	for(k=MP_LIMBS-1;k>=0 && k>=MP_LIMBS-3;k--) {
+		v += (double)u.l[k]*unit;
+		unit *= 0x1p-64;
+	}
+
+	/* tiny values live further down */
+	for(;k>=0 && v==0;k--) {
+		v = (double)u.l[k]*unit;
+		if(k>0) v += (double)u.l[k-1]*unit*0x1p-64;
+		unit *= 0x1p-64;
+	}
+
+	return neg ? -v : v;
+}
+
+/*
+Parse a decimal number such as "-0.743643887037158704752191506114774"
+or "1.5e-3" exactly to the precision of the format.  The digits d1 d2 ...
+are folded in from the last one as 0.d1d2... and then scaled by powers
+of ten for the position of the point and the exponent.
+*/
+
+static int mp_from_string( struct mp *r, const char *s ) {
+	const char *digits, *p;
+	int neg = 0, point = -1, ndigits = 0, shift, e = 0, k;
+
+	memset(r,0,sizeof(*r));
+
+	if(*s=='-' || *s=='+') neg = (*s++=='-');
+
+	digits = s;
+	for(p=s; (*p>='0' && *p<='9') || *p=='.'; p++) {
+		if(*p=='.') {
+			if(point>=0) return 0;
+			point = ndigits;
+		} else {
+			ndigits++;
+		}
+	}
+	if(ndigits==0) return 0;
+	if(point<0) point = ndigits;
+
+	if(*p=='e' || *p=='E') {
+		e = atoi(p+1);
+	} else if(*p) {
+		return 0;
+	}
+
+	for(k=p-digits-1;k>=0;k--) {
+		if(digits[k]=='.') continue;
+		r->l[MP_LIMBS-1] += digits[k]-'0';
+		mp_div_small(r,10);
+	}
+
+	for(shift=point+e; shift>0; shift--) mp_mul_small(r,10);
+	for(; shift<0; shift++) mp_div_small(r,10);
+
+	if(neg) mp_neg(r);
+	return 1;
+}
+
+/* The reference orbit Z[0] = 0, Z[1] = C, ..., rounded to double. */
+static double *ref_x = 0;
+static double *ref_y = 0;
+static int     ref_len = 0;
+
+static long rebases = 0;
+
+long perturb_rebases() {
+	return __atomic_load_n(&rebases,__ATOMIC_RELAXED);
+}
+
+/*
+Compute the reference orbit of the centre for up to max iterations, or
+until it escapes.  Returns 0 if a coordinate cannot be parsed or memory
+runs out.
+*/
+
+int perturb_init( const char *xcenter, const char *ycenter, int max ) {
+	struct mp cx, cy, zx, zy, xx, yy, xy, t;
+	int n;
+
+	if(!mp_from_string(&cx,xcenter) || !mp_from_string(&cy,ycenter)) return 0;
+
+	free(ref_x);
+	free(ref_y);
+	ref_x = malloc((max+2)*sizeof(double));
+	ref_y = malloc((max+2)*sizeof(double));
+	if(!ref_x || !ref_y) return 0;
+
+	memset(&zx,0,sizeof(zx));
+	memset(&zy,0,sizeof(zy));
+
+	for(n=0; n<=max+1; n++) {
+		ref_x[n] = mp_to_double(&zx);
+		ref_y[n] = mp_to_double(&zy);
+
+		if(ref_x[n]*ref_x[n] + ref_y[n]*ref_y[n] > 4) {
+			n++;
+			break;
+		}
+
+		/* Z' = Z*Z + C */
+		mp_mul(&xx,&zx,&zx);
+		mp_mul(&yy,&zy,&zy);
+		mp_mul(&xy,&zx,&zy);
+		mp_sub(&t,&xx,&yy);
+		mp_add(&zx,&t,&cx);
+		mp_add(&t,&xy,&xy);
+		mp_add(&zy,&t,&cy);
+	}
+
+	ref_len = n;
+	return 1;
+}
+
+/*
+Iterate the pixel at offset (dcx,dcy) from the centre.  The count matches
+the plain kernels: the number of iterations before |z| exceeds 2,
+checking z[1] ... z[max].
+*/
+
+static int perturb_point( double dcx, double dcy, int max, long *rebased ) {
+	double dx = 0, dy = 0;
+	int n = 0;
+	int m;
+
+	for(m=1; m<=max; m++) {
+		double zx = ref_x[n];
+		double zy = ref_y[n];
+
+		/* dz = 2*Z*dz + dz*dz + dc */
+		double tx = 2*(zx*dx - zy*dy) + (dx*dx - dy*dy) + dcx;
+		double ty = 2*(zx*dy + zy*dx) + 2*dx*dy + dcy;
+		dx = tx;
+		dy = ty;
+		n++;
+
+		zx = ref_x[n] + dx;
+		zy = ref_y[n] + dy;
+		double mag = zx*zx + zy*zy;
+
+		if(mag > 4) return m-1;
+
+		/* rebase when the offset outgrows the orbit, or the reference runs out */
+		if(mag < dx*dx + dy*dy || n == ref_len-1) {
+			dx = zx;
+			dy = zy;
+			n = 0;
+			(*rebased)++;
+		}
+	}
+
+	return max;
+}
+
+void perturb_points( const double *dx, const double *dy, int n, int max, int *iters ) {
+	long rebased = 0;
+	int i;
+
+	for(i=0;i<n;i++) {
+		iters[i] = perturb_point(dx[i],dy[i],max,&rebased);
+	}
+
+	if(rebased) __atomic_add_fetch(&rebases,rebased,__ATOMIC_RELAXED);
+}
@@ -0,0 +1,16 @@
+
+#ifndef PERTURB_H
+#define PERTURB_H
+
+/*
+Deep zoom by perturbation.  perturb_init() computes the orbit of the
+image centre, given as decimal strings, in high precision.  After that
+perturb_points() is a kernel (see kernel.h) whose x and y are offsets
+from the centre rather than absolute coordinates, computed in double.
+*/
+
+int   perturb_init( const char *xcenter, const char *ycenter, int max );
+void  perturb_points( const double *dx, const double *dy, int n, int max, int *iters );
+long  perturb_rebases();
+
+#endif
@@ -0,0 +1,334 @@
+
+#include "png.h"
+#include "bitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+/*
+The image data of a PNG is one zlib stream, but it doesn't have to be
+deflated in one piece.  Each band is deflated on its own and ended with
+a sync flush, which leaves it on a byte boundary, and only the last band
+of the image is finished.  The pieces written one after another make a
+single valid stream; their Adler-32 checksums are combined in order for
+the zlib trailer.  Every band goes out as its own IDAT chunk.
+*/
+
+/* About how much filtered data one band holds */
+#define PNG_BAND_BYTES (4<<20)
+
+/* Splitting a call between threads, no band gets fewer rows than this */
+#define PNG_MIN_ROWS 16
+
+#define PNG_MAX_THREADS 64
+
+/* Threads splitting each write, see png_set_threads() */
+static int png_threads = 1;
+
+#define PNG_LEVEL 6
+
+struct png_band {
+	pthread_t tid;
+	int threaded;
+	int width;
+	const int *rgba;
+	long stride;
+	int rows;
+	int last;
+	const unsigned char *above;
+	unsigned char *cur;
+	unsigned char *prev;
+	unsigned char *raw;
+	size_t rawlength;
+	unsigned char *out;
+	size_t outsize;
+	size_t outlength;
+	uLong adler;
+	int ok;
+};
+
+struct png_stream {
+	FILE *file;
+	int width;
+	int height;
+	int row;
+	int ok;
+	size_t rowbytes;
+	int bandrows;
+	int nbands;
+	struct png_band *bands;
+	unsigned char *above;
+	uLong adler;
+};
+
+static void put32( unsigned char *p, unsigned long v )
+{
+	p[0] = v>>24;
+	p[1] = v>>16;
+	p[2] = v>>8;
+	p[3] = v;
+}
+
+static void write_chunk( struct png_stream *s, const char *type, const unsigned char *data, size_t length )
+{
+	unsigned char head[8], tail[4];
+	uLong crc;
+
+	put32(head,length);
+	memcpy(head+4,type,4);
+	crc = crc32(0,head+4,4);
+	if(length) crc = crc32(crc,data,length);
+	put32(tail,crc);
+
+	if(fwrite(head,1,8,s->file) != 8) s->ok = 0;
+	if(length && fwrite(data,1,length,s->file) != length) s->ok = 0;
+	if(fwrite(tail,1,4,s->file) != 4) s->ok = 0;
+}
+
+static void rgba_to_rgb( const int *src, unsigned char *dst, int n )
+{
+	int i;
+	for(i=0;i<n;i++) {
+		int rgba = src[i];
+		*dst++ = GET_RED(rgba);
+		*dst++ = GET_GREEN(rgba);
+		*dst++ = GET_BLUE(rgba);
+	}
+}
+
+static unsigned long sum_none( const unsigned char *cur, int n )
+{
+	unsigned long sum = 0;
+	int i;
+	for(i=0;i<n;i++) sum += abs((signed char)cur[i]);
+	return sum;
+}
+
+static unsigned long sum_sub( const unsigned char *cur, int n )
+{
+	unsigned long sum = 0;
+	int i;
+	for(i=0;i<n;i++) sum += abs((signed char)(cur[i] - (i>=3 ? cur[i-3] : 0)));
+	return sum;
+}
+
+static unsigned long sum_up( const unsigned char *cur, const unsigned char *above, int n )
+{
+	unsigned long sum = 0;
+	int i;
+	for(i=0;i<n;i++) sum += abs((signed char)(cur[i] - above[i]));
+	return sum;
+}
+
+/*
+Filter one row of n bytes into dst, using whichever of None, Sub and Up
+gives the smallest sum of differences: the usual rule of thumb for which
+will deflate best.
+*/
+static void filter_row( const unsigned char *cur, const unsigned char *above, int n, unsigned char *dst )
+{
+	unsigned long none = sum_none(cur,n);
+	unsigned long sub = sum_sub(cur,n);
+	unsigned long up = sum_up(cur,above,n);
+	int i;
+
+	if(none <= sub && none <= up) {
+		*dst++ = 0;
+		memcpy(dst,cur,n);
+	} else if(sub <= up) {
+		*dst++ = 1;
+		for(i=0;i<n;i++) dst[i] = cur[i] - (i>=3 ? cur[i-3] : 0);
+	} else {
+		*dst++ = 2;
+		for(i=0;i<n;i++) dst[i] = cur[i] - above[i];
+	}
+}
+
+static void * deflate_band( void *arg )
+{
+	struct png_band *b = arg;
+	const unsigned char *above = b->above;
+	int n = b->width*3;
+	unsigned char *raw = b->raw;
+	z_stream z;
+	int j, status;
+
+	for(j=0;j<b->rows;j++) {
+		unsigned char *swap;
+		rgba_to_rgb(b->rgba + j*b->stride,b->cur,b->width);
+		filter_row(b->cur,above,n,raw);
+		raw += n+1;
+
+		/* this row is the one above the next */
+		swap = b->prev;
+		b->prev = b->cur;
+		b->cur = swap;
+		above = b->prev;
+	}
+	b->rawlength = raw - b->raw;
+	b->adler = adler32(adler32(0,0,0),b->raw,b->rawlength);
+
+	memset(&z,0,sizeof(z));
+	if(deflateInit2(&z,PNG_LEVEL,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) != Z_OK) {
+		b->ok = 0;
+		return NULL;
+	}
+	z.next_in = b->raw;
+	z.avail_in = b->rawlength;
+	z.next_out = b->out;
+	z.avail_out = b->outsize;
+	status = deflate(&z,b->last ? Z_FINISH : Z_SYNC_FLUSH);
+	b->ok = b->last ? status == Z_STREAM_END : status == Z_OK && z.avail_in == 0 && z.avail_out > 0;
+	b->outlength = b->outsize - z.avail_out;
+	deflateEnd(&z);
+	return NULL;
+}
+
+/* Deflate on up to threads threads, the calling one included (mandel -t). */
+void png_set_threads( int threads )
+{
+	png_threads = threads < 1 ? 1 : threads > PNG_MAX_THREADS ? PNG_MAX_THREADS : threads;
+}
+
+struct png_stream * png_stream_open( FILE *file, int w, int h )
+{
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	static const unsigned char zlib_header[2] = { 0x78, 0x9c };
+	struct png_stream *s;
+	unsigned char ihdr[13];
+	int i;
+
+	if(w<1 || h<1) return 0;
+
+	s = calloc(1,sizeof(*s));
+	if(!s) return 0;
+
+	s->file = file;
+	s->width = w;
+	s->height = h;
+	s->ok = 1;
+	s->adler = adler32(0,0,0);
+	s->rowbytes = (size_t)w*3 + 1;
+
+	s->bandrows = PNG_BAND_BYTES / s->rowbytes;
+	if(s->bandrows < PNG_MIN_ROWS) s->bandrows = PNG_MIN_ROWS;
+	if(s->bandrows > h) s->bandrows = h;
+
+	s->nbands = png_threads;
+
+	/* the row above the top row counts as zeros */
+	s->above = calloc(w,3);
+	s->bands = calloc(s->nbands,sizeof(*s->bands));
+	if(!s->above || !s->bands) goto fail;
+
+	for(i=0;i<s->nbands;i++) {
+		struct png_band *b = &s->bands[i];
+		b->width = w;
+		b->cur = malloc((size_t)w*3);
+		b->prev = malloc((size_t)w*3);
+		b->raw = malloc(s->bandrows*s->rowbytes);
+		b->outsize = compressBound(s->bandrows*s->rowbytes) + 16;
+		b->out = malloc(b->outsize);
+		if(!b->cur || !b->prev || !b->raw || !b->out) goto fail;
+	}
+
+	put32(ihdr,w);
+	put32(ihdr+4,h);
+	ihdr[8] = 8;	/* bits per sample */
+	ihdr[9] = 2;	/* RGB */
+	ihdr[10] = 0;	/* deflate */
+	ihdr[11] = 0;	/* adaptive filtering */
+	ihdr[12] = 0;	/* not interlaced */
+
+	if(fwrite(signature,1,8,file) != 8) s->ok = 0;
+	write_chunk(s,"IHDR",ihdr,13);
+	write_chunk(s,"IDAT",zlib_header,2);
+	return s;
+
+fail:
+	png_stream_close(s);
+	return 0;
+}
+
+int png_stream_write( struct png_stream *s, const int *rgba, int rows, long stride )
+{
+	if(s->row + rows > s->height) s->ok = 0;
+
+	while(rows > 0 && s->ok) {
+		int per = (rows + s->nbands - 1) / s->nbands;
+		int n, i;
+
+		if(per < PNG_MIN_ROWS) per = PNG_MIN_ROWS;
+		if(per > s->bandrows) per = s->bandrows;
+
+		/* hand out the next bands, the first done on this thread */
+		for(n=0; n<s->nbands && rows>0; n++) {
+			struct png_band *b = &s->bands[n];
+			b->rgba = rgba;
+			b->stride = stride;
+			b->rows = rows < per ? rows : per;
+			b->last = s->row + b->rows == s->height;
+			b->ok = 1;
+
+			/* the first band's row above is left over from the last call */
+			if(n == 0) {
+				b->above = s->above;
+			} else {
+				rgba_to_rgb(rgba - stride,b->prev,s->width);
+				b->above = b->prev;
+			}
+
+			rgba += b->rows*stride;
+			rows -= b->rows;
+			s->row += b->rows;
+
+			b->threaded = n > 0 && pthread_create(&b->tid,NULL,deflate_band,b) == 0;
+			if(n > 0 && !b->threaded) deflate_band(b);
+		}
+		deflate_band(&s->bands[0]);
+
+		for(i=0;i<n;i++) {
+			struct png_band *b = &s->bands[i];
+			if(b->threaded) pthread_join(b->tid,NULL);
+			if(!b->ok) s->ok = 0;
+			if(!s->ok) continue;
+			write_chunk(s,"IDAT",b->out,b->outlength);
+			s->adler = adler32_combine(s->adler,b->adler,b->rawlength);
+		}
+
+		/* deflate_band leaves its last row in prev */
+		memcpy(s->above,s->bands[n-1].prev,(size_t)s->width*3);
+	}
+
+	return s->ok;
+}
+
+/* Finish the image, or just free the stream if it was never completed. */
+int png_stream_close( struct png_stream *s )
+{
+	int ok = s->ok && s->row == s->height;
+	int i;
+
+	if(ok) {
+		unsigned char trailer[4];
+		put32(trailer,s->adler);
+		write_chunk(s,"IDAT",trailer,4);
+		write_chunk(s,"IEND",0,0);
+		ok = s->ok;
+	}
+
+	if(s->bands) {
+		for(i=0;i<s->nbands;i++) {
+			free(s->bands[i].cur);
+			free(s->bands[i].prev);
+			free(s->bands[i].raw);
+			free(s->bands[i].out);
+		}
+	}
+	free(s->bands);
+	free(s->above);
+	free(s);
+	return ok;
+}
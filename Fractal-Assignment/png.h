@@ -0,0 +1,20 @@
+
+#ifndef PNG_H
+#define PNG_H
+
+#include <stdio.h>
+
+/*
+A PNG encoder for 24-bit RGB images, written a few rows at a time, top
+row first.  Each call splits its rows into bands that are filtered and
+deflated in parallel, on as many threads as png_set_threads() allows,
+and written out in order as IDAT chunks.  Rows are given as RGBA pixels, stride ints apart, so a
+negative stride hands over rows stored bottom-up.
+*/
+
+void                png_set_threads( int threads );
+struct png_stream * png_stream_open( FILE *file, int w, int h );
+int                 png_stream_write( struct png_stream *s, const int *rgba, int rows, long stride );
+int                 png_stream_close( struct png_stream *s );
+
+#endif
@@ -0,0 +1,153 @@
+
+#define _GNU_SOURCE
+
+#include "pool.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+/*
+Workers sleep on "start" until pool_run() bumps the generation, run the
+function once, and the last one to finish wakes pool_run() on "done".
+*/
+
+static pthread_t *tids = 0;
+static int nthreads = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static unsigned long generation = 0;
+static int remaining = 0;
+static int stopping = 0;
+static pool_func job_func;
+static void *job_arg;
+
+struct worker {
+	int id;
+	int cpu;
+	unsigned long seen;
+};
+
+static void * worker_main( void *arg ) {
+	struct worker w = *(struct worker *)arg;
+	unsigned long seen = w.seen;
+	pool_func func;
+	void *fa;
+
+	free(arg);
+
+	if(w.cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w.cpu,&set);
+		pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+	}
+
+	for(;;) {
+		pthread_mutex_lock(&lock);
+		while(generation == seen && !stopping) {
+			pthread_cond_wait(&start,&lock);
+		}
+		if(stopping) {
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		seen = generation;
+		func = job_func;
+		fa = job_arg;
+		pthread_mutex_unlock(&lock);
+
+		func(fa,w.id);
+
+		pthread_mutex_lock(&lock);
+		if(--remaining == 0) pthread_cond_signal(&done);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+/* The n-th CPU this process may run on, wrapping around. */
+static int nth_cpu( int n ) {
+	cpu_set_t set;
+	int cpu, count;
+
+	if(sched_getaffinity(0,sizeof(set),&set) < 0) return -1;
+	count = CPU_COUNT(&set);
+	if(count == 0) return -1;
+
+	n %= count;
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if(CPU_ISSET(cpu,&set) && n-- == 0) return cpu;
+	}
+	return -1;
+}
+
+/*
+Start the workers, replacing any running pool.  With pin set, worker i
+is bound to the i-th CPU the process may use.  Returns the number of
+workers actually started, 0 if none could be.
+*/
+
+int pool_start( int threads, int pin ) {
+	int i;
+
+	pool_stop();
+	if(threads < 1) threads = 1;
+
+	tids = malloc(threads*sizeof(*tids));
+	if(!tids) return 0;
+
+	for(i = 0; i < threads; i++) {
+		struct worker *w = malloc(sizeof(*w));
+		if(!w) break;
+		w->id = i;
+		w->cpu = pin ? nth_cpu(i) : -1;
+		w->seen = generation;
+		if(pthread_create(&tids[i],NULL,worker_main,w) != 0) {
+			free(w);
+			break;
+		}
+	}
+	nthreads = i;
+	return nthreads;
+}
+
+int pool_threads() {
+	return nthreads;
+}
+
+/* Run func(arg,id) on every worker and wait for all of them. */
+void pool_run( pool_func func, void *arg ) {
+	if(nthreads == 0 && !pool_start(1,0)) return;
+
+	pthread_mutex_lock(&lock);
+	job_func = func;
+	job_arg = arg;
+	remaining = nthreads;
+	generation++;
+	pthread_cond_broadcast(&start);
+	while(remaining > 0) {
+		pthread_cond_wait(&done,&lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void pool_stop() {
+	int i;
+
+	if(!tids) return;
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_broadcast(&start);
+	pthread_mutex_unlock(&lock);
+
+	for(i = 0; i < nthreads; i++) {
+		pthread_join(tids[i],NULL);
+	}
+
+	free(tids);
+	tids = 0;
+	nthreads = 0;
+	stopping = 0;
+}
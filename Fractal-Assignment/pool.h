@@ -0,0 +1,18 @@
+
+#ifndef POOL_H
+#define POOL_H
+
+/*
+A pool of worker threads started once and reused by every render.
+pool_run() hands the same function to all workers, each called with its
+worker id from 0 to pool_threads()-1, and returns when all have finished.
+*/
+
+typedef void (*pool_func)( void *arg, int id );
+
+int   pool_start( int threads, int pin );
+void  pool_run( pool_func func, void *arg );
+int   pool_threads();
+void  pool_stop();
+
+#endif
@@ -0,0 +1,284 @@
+
+#include "stats.h"
+#include "kernel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+A slot per worker, each on its own cache line so the workers don't
+slow each other down updating them.  Points and iterations first pile
+up in thread local counters, since the kernels are called far more
+often than tiles finish.
+
+With a trace (-T) every tile, and the wait of every worker for the rest
+at the end of a pass, is also kept as an event: each worker appends to
+its own list, the main thread to its own for the passes.  The cost of
+tiles is added up afterwards in a heatmap of the image, one cell per
+TRACE_CELL pixels square.
+*/
+
+#define TRACE_CELL 32
+
+enum { EVENT_TILE, EVENT_IDLE, EVENT_PASS };
+
+struct event {
+	int kind;
+	int x;
+	int y;
+	double start;
+	double end;
+	long points;
+	double iterations;
+};
+
+struct event_list {
+	struct event *events;
+	long count;
+	long size;
+};
+
+struct thread_stats {
+	double busy;
+	double idle;
+	double finished;
+	long tiles;
+	long points;
+	double iterations;
+	struct event_list trace;
+} __attribute__((aligned(64)));
+
+static struct thread_stats *slots = 0;
+static int nslots = 0;
+static double compute_seconds = 0;
+static long compute_pixels = 0;
+
+static int tracing = 0;
+static double trace_start;
+static struct event_list passes;
+static int trace_width, trace_height;
+
+static __thread long thread_points = 0;
+static __thread double thread_iterations = 0;
+
+/* Seconds on a clock that only goes forwards. */
+double stats_now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+void stats_start( int threads ) {
+	int i;
+
+	for(i = 0; i < nslots; i++) free(slots[i].trace.events);
+	free(slots);
+	nslots = threads;
+	slots = aligned_alloc(64,sizeof(*slots)*threads);
+	if(!slots) {
+		nslots = 0;
+		return;
+	}
+	memset(slots,0,sizeof(*slots)*threads);
+	compute_seconds = 0;
+	compute_pixels = 0;
+}
+
+/*
+Count n points just handed to the kernel, and the iterations it returned
+for them less those it skipped, so only iterations actually run count.
+*/
+void stats_points( const int *iters, int n ) {
+	long sum = 0;
+	int k;
+	for(k = 0; k < n; k++) sum += iters[k];
+	thread_points += n;
+	thread_iterations += sum - kernel_unrun();
+}
+
+/* Start tracing the render of a width x height image. */
+void stats_trace( int width, int height ) {
+	trace_width = width;
+	trace_height = height;
+	tracing = 1;
+	trace_start = stats_now();
+}
+
+/* Events that don't fit are dropped, the trace is only for looking at. */
+static void add_event( struct event_list *list, int kind, int x, int y, double start, double end, long points, double iterations ) {
+	struct event *e;
+
+	if(list->count == list->size) {
+		long size = list->size ? 2*list->size : 1024;
+		struct event *events = realloc(list->events,size*sizeof(*events));
+		if(!events) return;
+		list->events = events;
+		list->size = size;
+	}
+
+	e = &list->events[list->count++];
+	e->kind = kind;
+	e->x = x;
+	e->y = y;
+	e->start = start;
+	e->end = end;
+	e->points = points;
+	e->iterations = iterations;
+}
+
+/* Worker id finished the tile at pixel x,y of the image, started at start. */
+void stats_tile( int id, int x, int y, double start, double end ) {
+	struct thread_stats *s;
+
+	if(id >= nslots) return;
+	s = &slots[id];
+	s->busy += end - start;
+	s->tiles++;
+	s->points += thread_points;
+	s->iterations += thread_iterations;
+
+	if(tracing) add_event(&s->trace,EVENT_TILE,x,y,start,end,thread_points,thread_iterations);
+
+	thread_points = 0;
+	thread_iterations = 0;
+}
+
+/* Worker id has run out of tiles for this pass. */
+void stats_finish( int id ) {
+	if(id < nslots) slots[id].finished = stats_now();
+}
+
+/*
+A compute pass ran from start to end, producing pixels finished pixels.
+Workers that finished early sat idle until the end.
+*/
+
+void stats_compute( double start, double end, long pixels ) {
+	int i;
+
+	compute_seconds += end - start;
+	compute_pixels += pixels;
+
+	for(i = 0; i < nslots; i++) {
+		double finished = slots[i].finished > start ? slots[i].finished : start;
+		slots[i].idle += end - finished;
+		if(tracing) add_event(&slots[i].trace,EVENT_IDLE,0,0,finished,end,0,0);
+	}
+	if(tracing) add_event(&passes,EVENT_PASS,0,0,start,end,pixels,0);
+}
+
+/*
+Write the statistics of the run to path.  Load imbalance is the busiest
+thread's time over the average; 1 is perfectly even.
+*/
+
+int stats_write( const char *path, const char *x, const char *y, double scale, int width, int height, int max, const char *kernel ) {
+	FILE *file = fopen(path,"w");
+	double busiest = 0, busy = 0, iterations = 0;
+	long points = 0;
+	int i;
+
+	if(!file) return 0;
+
+	for(i = 0; i < nslots; i++) {
+		if(slots[i].busy > busiest) busiest = slots[i].busy;
+		busy += slots[i].busy;
+		points += slots[i].points;
+		iterations += slots[i].iterations;
+	}
+
+	fprintf(file,"{\"x\":\"%s\",\"y\":\"%s\",\"scale\":%g,\"width\":%d,\"height\":%d,\"max\":%d,\"kernel\":\"%s\",\"threads\":%d,",
+		x,y,scale,width,height,max,kernel,nslots);
+	fprintf(file,"\"compute_seconds\":%.6f,\"pixels\":%ld,\"points\":%ld,\"iterations\":%.0f,",
+		compute_seconds,compute_pixels,points,iterations);
+	fprintf(file,"\"mpixels_per_sec\":%.3f,\"iterations_per_sec\":%.0f,\"imbalance\":%.4f,\"per_thread\":[",
+		compute_seconds > 0 ? compute_pixels/compute_seconds/1e6 : 0,
+		compute_seconds > 0 ? iterations/compute_seconds : 0,
+		busy > 0 ? busiest*nslots/busy : 1);
+	for(i = 0; i < nslots; i++) {
+		fprintf(file,"%s{\"busy_seconds\":%.6f,\"idle_seconds\":%.6f,\"tiles\":%ld,\"points\":%ld,\"iterations\":%.0f}",
+			i ? "," : "",slots[i].busy,slots[i].idle,slots[i].tiles,slots[i].points,slots[i].iterations);
+	}
+	fprintf(file,"]}\n");
+
+	return fclose(file) == 0;
+}
+
+static void write_events( FILE *file, const struct event_list *list, int tid, const char **sep ) {
+	long k;
+
+	for(k = 0; k < list->count; k++) {
+		const struct event *e = &list->events[k];
+		double ts = (e->start - trace_start)*1e6;
+		double dur = (e->end - e->start)*1e6;
+
+		fprintf(file,"%s\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,",*sep,tid,ts,dur);
+		if(e->kind == EVENT_TILE) {
+			fprintf(file,"\"name\":\"tile\",\"args\":{\"x\":%d,\"y\":%d,\"points\":%ld,\"iterations\":%.0f}}",e->x,e->y,e->points,e->iterations);
+		} else if(e->kind == EVENT_IDLE) {
+			fprintf(file,"\"name\":\"idle\"}");
+		} else {
+			fprintf(file,"\"name\":\"compute\",\"args\":{\"pixels\":%ld}}",e->points);
+		}
+		*sep = ",";
+	}
+}
+
+/*
+Write the trace to path in the Chrome trace event format, which
+chrome://tracing and Perfetto load: the workers and the main thread each
+get a track of tiles, idle waits and passes.  The heatmap goes alongside
+as tileHeatmap, the microseconds spent on each cell, row by row in the
+order of the tiles' y.
+*/
+
+int stats_write_trace( const char *path ) {
+	int columns = (trace_width + TRACE_CELL - 1) / TRACE_CELL;
+	int rows = (trace_height + TRACE_CELL - 1) / TRACE_CELL;
+	const char *sep = "";
+	double *heatmap;
+	FILE *file;
+	long k;
+	int i;
+
+	if(!tracing) return 0;
+
+	heatmap = calloc((size_t)columns*rows,sizeof(double));
+	if(!heatmap) return 0;
+
+	/* a tile lands in the cell of its top left pixel */
+	for(i = 0; i < nslots; i++) {
+		for(k = 0; k < slots[i].trace.count; k++) {
+			const struct event *e = &slots[i].trace.events[k];
+			if(e->kind != EVENT_TILE) continue;
+			heatmap[(long)(e->y/TRACE_CELL)*columns + e->x/TRACE_CELL] += e->end - e->start;
+		}
+	}
+
+	file = fopen(path,"w");
+	if(!file) {
+		free(heatmap);
+		return 0;
+	}
+
+	fprintf(file,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for(i = 0; i < nslots; i++) {
+		fprintf(file,"%s\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"worker %d\"}}",sep,i,i);
+		sep = ",";
+		write_events(file,&slots[i].trace,i,&sep);
+	}
+	fprintf(file,"%s\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"main\"}}",sep,nslots);
+	sep = ",";
+	write_events(file,&passes,nslots,&sep);
+
+	fprintf(file,"\n],\"tileHeatmap\":{\"cell\":%d,\"columns\":%d,\"rows\":%d,\"microseconds\":[",TRACE_CELL,columns,rows);
+	for(k = 0; k < (long)columns*rows; k++) {
+		fprintf(file,"%s%s%.1f",k ? "," : "",k % columns == 0 ? "\n" : "",heatmap[k]*1e6);
+	}
+	fprintf(file,"]}}\n");
+	free(heatmap);
+
+	return fclose(file) == 0;
+}
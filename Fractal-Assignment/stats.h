@@ -0,0 +1,23 @@
+
+#ifndef STATS_H
+#define STATS_H
+
+/*
+Render statistics for benchmarks.  Each worker thread adds the time it
+spends on tiles, and the points it iterates, to its own slot, and the
+time it waits for the others at the end of each pass.  The totals of a
+run go out as one JSON object.  Optionally every tile and wait is traced
+too, for a timeline of the threads in the Chrome trace format.
+*/
+
+double stats_now();
+void   stats_start( int threads );
+void   stats_trace( int width, int height );
+void   stats_points( const int *iters, int n );
+void   stats_tile( int id, int x, int y, double start, double end );
+void   stats_finish( int id );
+void   stats_compute( double start, double end, long pixels );
+int    stats_write( const char *path, const char *x, const char *y, double scale, int width, int height, int max, const char *kernel );
+int    stats_write_trace( const char *path );
+
+#endif
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Tests of the tile cache, run by "make test".  Renders a few views with
+# and without a cache directory and checks the cache is used where it
+# should be, and that cached images match uncached ones byte for byte.
+
+mandel=${MANDEL:-./mandel}
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+# render name options...: render into $dir/name.bmp, printing the cache hits
+render() {
+	name=$1
+	shift
+	$mandel "$@" -o "$dir/$name.bmp" | sed -n 's/^mandel: \([0-9]*\) tiles found in the cache.*/\1/p'
+}
+
+fail() {
+	echo "test: $*" >&2
+	failed=1
+}
+
+same() {
+	cmp -s "$dir/$1.bmp" "$dir/$2.bmp" || fail "$1 and $2 differ"
+}
+
+# Panning by whole pixels at a fixed scale reuses the tiles seen before.
+render pan0 -x -0.5 -y -0.5 -s 0.2 -c "$dir/pan" >/dev/null
+for x in -0.4 -0.3; do
+	hits=$(render pan -x $x -y -0.5 -s 0.2 -c "$dir/pan")
+	[ "${hits:-0}" -gt 0 ] || fail "panning to x=$x found no cached tiles"
+	render plain -x $x -y -0.5 -s 0.2 >/dev/null
+	same pan plain
+done
+
+# Mariani-Silver tiles are never served to a pixel render.
+render ms -x -0.5 -y -0.5 -s 0.2 -r ms -c "$dir/ms" >/dev/null
+hits=$(render pixel -x -0.5 -y -0.5 -s 0.2 -c "$dir/ms")
+[ "${hits:-0}" -eq 0 ] || fail "a pixel render found $hits Mariani-Silver tiles"
+render plain -x -0.5 -y -0.5 -s 0.2 >/dev/null
+same pixel plain
+
+# A second render finds every tile, in bands and in memory.
+render first -x -.38 -y -.665 -s .05 -m 100 -t 3 -c "$dir/again" >/dev/null
+hits=$(render again -x -.38 -y -.665 -s .05 -m 100 -t 3 -c "$dir/again")
+misses=$($mandel -x -.38 -y -.665 -s .05 -m 100 -t 3 -c "$dir/again" -I "$dir/counts" -o "$dir/memory.bmp" | sed -n 's/.* cache, \([0-9]*\) computed$/\1/p')
+[ "${hits:-0}" -gt 0 ] && [ "${misses:-1}" -eq 0 ] || fail "a repeated render missed the cache"
+same first again
+same first memory
+
+[ $failed -eq 0 ] && echo "test: all passed"
+exit $failed
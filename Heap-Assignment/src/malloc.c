@@ -1,16 +1,20 @@
-#include <assert.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 
-#define ALIGN4(s)         (((((s) - 1) >> 2) << 2) + 4)
 #define BLOCK_DATA(b)      ((b) + 1)
 #define BLOCK_HEADER(ptr)   ((struct _block *)(ptr) - 1)
 
 
-static int atexit_registered = 0;
+/* serve this thread's allocations from the bootstrap arena; initial-exec
+   so reading it never calls back into malloc() to set up the TLS block */
+static __thread int bootstrapping __attribute__((tls_model("initial-exec"))) = 0;
 static int num_mallocs       = 0;
 static int num_frees         = 0;
 static int num_reuses        = 0;
@@ -20,6 +24,7 @@ static int num_coalesces     = 0;
 static int num_blocks        = 0;
 static int num_requested     = 0;
 static int max_heap          = 0;
+static int num_size_classes  = 0;
 
 /*
  *  \brief printStatistics
@@ -33,6 +38,9 @@ static int max_heap          = 0;
  */
 void printStatistics( void )
 {
+  /* printf() may allocate its buffer, keep that off the heap being reported */
+  bootstrapping++;
+
   printf("\nheap management statistics\n");
   printf("mallocs:\t%d\n", num_mallocs);
   printf("frees:\t\t%d\n", num_frees );
@@ -43,42 +51,501 @@ void printStatistics( void )
   printf("blocks:\t\t%d\n", num_blocks );
   printf("requested:\t%d\n", num_requested );
   printf("max heap:\t%d\n", max_heap );
+  printf("size classes:\t%d\n", num_size_classes );
+  fflush(stdout);
+
+  bootstrapping--;
 }
 
+/*
+ * Block layout
+ *
+ * Every _block is a single header word followed by its payload.  Payload
+ * sizes are kept a multiple of the word size, so the low bits of the
+ * header are always zero and carry the block flags instead:
+ *
+ *    in use:  [ size | flags ][ user data ...                        ]
+ *    free:    [ size | flags ][ next ][ prev ] ...          [ size ]
+ *
+ * The free list links and a footer (the payload size, used to find the
+ * start of a free block from its right neighbour) live inside the payload
+ * of free blocks only, so an allocated block costs one word of overhead
+ * and a free list walk touches only the header and the links right after
+ * it, three adjacent words.  Blocks are only word aligned, so those words
+ * can still straddle a cache line.
+ *
+ * Each contiguous sbrk() segment is terminated by a zero sized, in use
+ * epilogue header so walking to the physical neighbour never leaves
+ * the heap.
+ */
 struct _block 
 {
-   size_t  size;         /* Size of the allocated _block of memory in bytes */
-   struct _block *prev;  /* Pointer to the previous _block of allcated memory   */
-   struct _block *next;  /* Pointer to the next _block of allcated memory   */
-   bool   free;          /* Is this _block free?                     */
-   char   padding[3];
+   size_t  size;         /* Payload size in bytes, BLOCK_* flags in the low bits */
 };
 
+struct _links
+{
+   struct _block *next;  /* Next free _block, in address order     */
+   struct _block *prev;  /* Previous free _block, in address order */
+};
+
+#define BLOCK_FREE         ((size_t)0x1)  /* this _block is free            */
+#define BLOCK_PREV_FREE    ((size_t)0x2)  /* the physical predecessor is free */
+#define BLOCK_FLAGS        ((size_t)(sizeof(size_t) - 1))
+
+#define BLOCK_SIZE(b)      ((b)->size & ~BLOCK_FLAGS)
+#define BLOCK_IS_FREE(b)   (((b)->size & BLOCK_FREE) != 0)
+#define BLOCK_LINKS(b)     ((struct _links *)BLOCK_DATA(b))
+#define BLOCK_FOOTER(b)    ((size_t *)((char *)BLOCK_DATA(b) + BLOCK_SIZE(b)) - 1)
+#define BLOCK_NEXT(b)      ((struct _block *)((char *)BLOCK_DATA(b) + BLOCK_SIZE(b)))
+#define BLOCK_PREV(b)      ((struct _block *)((char *)(b) - ((size_t *)(b))[-1]) - 1)
+
+/* Round a payload to the header word so the flag bits stay clear */
+#define ALIGN_WORD(s)      (((s) + BLOCK_FLAGS) & ~BLOCK_FLAGS)
+
+/* A free _block must be able to hold its links and footer */
+#define MIN_PAYLOAD        (sizeof(struct _links) + sizeof(size_t))
+
+/* Largest request: rounding, the header, alignment padding and the
+   epilogue all have to fit without the size wrapping around */
+#define MAX_PAYLOAD        ((size_t)PTRDIFF_MAX - 4 * sizeof(struct _block))
+
 
 struct _block *freeList = NULL; /* Free list to track the _blocks available */
+struct _block *heapEnd  = NULL; /* Epilogue of the most recent heap segment */
 
 #if defined NEXT && NEXT == 0
  struct _block * LAST_NF_VISITED = NULL;
 #endif
 
+/*
+ * Size classes
+ *
+ * When MALLOC_SIZE_CLASSES names a file, requests are rounded up to a
+ * small set of size classes so freed blocks can be reused by later
+ * requests of nearby sizes.  If the file exists the classes are loaded
+ * from it.  Otherwise the aligned request sizes of the first
+ * MALLOC_WARMUP mallocs are recorded, the classes that minimise internal
+ * fragmentation for that histogram are derived and written to the file
+ * for the next run.  Requests larger than the biggest class are not
+ * rounded.
+ *
+ * The file is plain text, one class size per line.  It is read and
+ * written with open()/read()/write() since stdio would call back into
+ * malloc().
+ */
+#define MAX_SIZE_CLASSES      16
+#define SIZE_CLASS_LIMIT      4096   /* largest request that is recorded   */
+#define DEFAULT_WARMUP        10000  /* mallocs observed before tuning     */
+
+static size_t       size_classes[MAX_SIZE_CLASSES];
+static const char  *size_class_file = NULL;
+static int          size_class_warmup = 0;
+static unsigned int size_histogram[SIZE_CLASS_LIMIT / 4 + 1];
+
+/*
+ * \brief sizeClassLoad
+ *
+ * \param path file holding one class size per line
+ *
+ * \return the number of classes read, 0 if the file is missing or empty
+ */
+static int sizeClassLoad(const char *path)
+{
+   char    buf[MAX_SIZE_CLASSES * 24];
+   ssize_t len;
+   size_t  value = 0;
+   bool    digits = false;
+   int     n = 0;
+   int     fd = open(path, O_RDONLY);
+
+   if (fd < 0)
+   {
+      return 0;
+   }
+
+   len = read(fd, buf, sizeof(buf));
+   close(fd);
+
+   /* the end of the file ends the last number too */
+   for (ssize_t i = 0; i <= len && n < MAX_SIZE_CLASSES; i++)
+   {
+      char c = i < len ? buf[i] : '\n';
+
+      if (c >= '0' && c <= '9')
+      {
+         value = value * 10 + (size_t)(c - '0');
+         digits = true;
+      }
+      else if (digits)
+      {
+         /* classes are stored as the block sizes they allocate, ascending */
+         size_t class = ALIGN_WORD(value);
+         if (class < MIN_PAYLOAD)
+         {
+            class = MIN_PAYLOAD;
+         }
+
+         if (value > 0 && (n == 0 || class > size_classes[n - 1]))
+         {
+            size_classes[n++] = class;
+         }
+         value = 0;
+         digits = false;
+      }
+   }
+
+   return n;
+}
+
+/*
+ * \brief sizeClassSave
+ *
+ * \param path file to (re)write with the current classes
+ *
+ * \return none
+ */
+static void sizeClassSave(const char *path)
+{
+   char line[24];
+   int  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+   if (fd < 0)
+   {
+      return;
+   }
+
+   for (int i = 0; i < num_size_classes; i++)
+   {
+      int len = snprintf(line, sizeof(line), "%zu\n", size_classes[i]);
+      if (write(fd, line, len) != len)
+      {
+         break;
+      }
+   }
+
+   close(fd);
+}
+
+/*
+ * \brief sizeClassDerive
+ *
+ * Picks at most MAX_SIZE_CLASSES class sizes from the recorded histogram
+ * minimising the total bytes wasted by rounding every recorded request
+ * up to its class.  The optimal classes are always observed sizes, so
+ * this is a dynamic program over the distinct sizes: waste[k][j] is the
+ * least waste covering sizes 0..j with k+1 classes, the last one at j.
+ *
+ * \return none
+ */
+static void sizeClassDerive(void)
+{
+   static unsigned long long waste[MAX_SIZE_CLASSES][SIZE_CLASS_LIMIT / 4];
+   static unsigned short     from[MAX_SIZE_CLASSES][SIZE_CLASS_LIMIT / 4];
+   static unsigned long long count_sum[SIZE_CLASS_LIMIT / 4 + 1];
+   static unsigned long long bytes_sum[SIZE_CLASS_LIMIT / 4 + 1];
+   static size_t             sizes[SIZE_CLASS_LIMIT / 4];
+   int m = 0;
+
+   /* Prefix sums over the distinct sizes so the waste of a class is O(1) */
+   for (int b = 1; b <= SIZE_CLASS_LIMIT / 4; b++)
+   {
+      if (size_histogram[b] == 0)
+      {
+         continue;
+      }
+
+      sizes[m] = (size_t)b * 4;
+      count_sum[m + 1] = count_sum[m] + size_histogram[b];
+      bytes_sum[m + 1] = bytes_sum[m] + (unsigned long long)size_histogram[b] * sizes[m];
+      m++;
+   }
+
+   if (m == 0)
+   {
+      return;
+   }
+
+   int k_max = m < MAX_SIZE_CLASSES ? m : MAX_SIZE_CLASSES;
+
+   /* waste of a class at sizes[j] covering sizes[i..j] */
+#define CLASS_WASTE(i, j) \
+   (sizes[j] * (count_sum[(j) + 1] - count_sum[i]) - (bytes_sum[(j) + 1] - bytes_sum[i]))
+
+   for (int j = 0; j < m; j++)
+   {
+      waste[0][j] = CLASS_WASTE(0, j);
+      from[0][j]  = 0;
+   }
+
+   for (int k = 1; k < k_max; k++)
+   {
+      for (int j = k; j < m; j++)
+      {
+         unsigned long long best = ~0ULL;
+
+         for (int i = k; i <= j; i++)
+         {
+            unsigned long long w = waste[k - 1][i - 1] + CLASS_WASTE(i, j);
+            if (w < best)
+            {
+               best = w;
+               from[k][j] = (unsigned short)i;
+            }
+         }
+
+         waste[k][j] = best;
+      }
+   }
+#undef CLASS_WASTE
+
+   /* Walk back from the largest size, which always closes the last class */
+   int j = m - 1;
+   for (int k = k_max - 1; k >= 0; k--)
+   {
+      size_classes[k] = sizes[j];
+      j = from[k][j] - 1;
+   }
+
+   num_size_classes = k_max;
+}
+
+/*
+ * \brief sizeClassInit
+ *
+ * Reads the MALLOC_SIZE_CLASSES and MALLOC_WARMUP environment variables
+ * and loads previously tuned classes if there are any.
+ *
+ * \return none
+ */
+static void sizeClassInit(void)
+{
+   const char *warmup;
+
+   size_class_file = getenv("MALLOC_SIZE_CLASSES");
+   if (size_class_file == NULL || *size_class_file == '\0')
+   {
+      size_class_file = NULL;
+      return;
+   }
+
+   num_size_classes = sizeClassLoad(size_class_file);
+
+   warmup = getenv("MALLOC_WARMUP");
+   size_class_warmup = warmup ? atoi(warmup) : DEFAULT_WARMUP;
+   if (size_class_warmup <= 0)
+   {
+      size_class_warmup = DEFAULT_WARMUP;
+   }
+}
+
+/*
+ * \brief sizeClassRound
+ *
+ * Records size while warming up, and rounds it to its class once the
+ * classes are known.  Sampling stops when the warmup ends, even if no
+ * classes came of it.
+ *
+ * \param size a request size already rounded to a block size
+ *
+ * \return the size to allocate
+ */
+static size_t sizeClassRound(size_t size)
+{
+   if (size_class_file == NULL)
+   {
+      return size;
+   }
+
+   if (num_size_classes == 0)
+   {
+      if (size_class_warmup <= 0)
+      {
+         return size;
+      }
+
+      if (size <= SIZE_CLASS_LIMIT)
+      {
+         size_histogram[size / 4]++;
+      }
+
+      if (--size_class_warmup == 0)
+      {
+         sizeClassDerive();
+         sizeClassSave(size_class_file);
+      }
+
+      return size;
+   }
+
+   /* smallest class that holds size */
+   int lo = 0;
+   int hi = num_size_classes;
+   while (lo < hi)
+   {
+      int mid = (lo + hi) / 2;
+      if (size_classes[mid] < size)
+      {
+         lo = mid + 1;
+      }
+      else
+      {
+         hi = mid;
+      }
+   }
+
+   return lo < num_size_classes ? size_classes[lo] : size;
+}
+
+/*
+ * \brief freeListInsert
+ *
+ * Links a free _block into the address ordered free list.
+ *
+ * \param b the _block to insert
+ *
+ * \return none
+ */
+static void freeListInsert(struct _block *b)
+{
+   struct _block *prev = NULL;
+   struct _block *curr = freeList;
+
+   while (curr && curr < b)
+   {
+      prev = curr;
+      curr = BLOCK_LINKS(curr)->next;
+   }
+
+   BLOCK_LINKS(b)->prev = prev;
+   BLOCK_LINKS(b)->next = curr;
+
+   if (curr)
+   {
+      BLOCK_LINKS(curr)->prev = b;
+   }
+
+   if (prev)
+   {
+      BLOCK_LINKS(prev)->next = b;
+   }
+   else
+   {
+      freeList = b;
+   }
+}
+
+/*
+ * \brief freeListReplace
+ *
+ * Puts b in the free list position currently held by old.  Used when a
+ * free _block moves by a split or a coalesce without changing its place
+ * in address order.
+ *
+ * \param old the _block currently on the free list
+ * \param b   the _block taking its place
+ *
+ * \return none
+ */
+static void freeListReplace(struct _block *old, struct _block *b)
+{
+   struct _links *l = BLOCK_LINKS(old);
+
+   BLOCK_LINKS(b)->prev = l->prev;
+   BLOCK_LINKS(b)->next = l->next;
+
+   if (l->next)
+   {
+      BLOCK_LINKS(l->next)->prev = b;
+   }
+
+   if (l->prev)
+   {
+      BLOCK_LINKS(l->prev)->next = b;
+   }
+   else
+   {
+      freeList = b;
+   }
+
+#if defined NEXT && NEXT == 0
+   if (LAST_NF_VISITED == old)
+   {
+      LAST_NF_VISITED = b;
+   }
+#endif
+}
+
+/*
+ * \brief freeListRemove
+ *
+ * Unlinks a _block from the free list.
+ *
+ * \param b the _block to remove
+ *
+ * \return none
+ */
+static void freeListRemove(struct _block *b)
+{
+   struct _links *l = BLOCK_LINKS(b);
+
+   if (l->next)
+   {
+      BLOCK_LINKS(l->next)->prev = l->prev;
+   }
+
+   if (l->prev)
+   {
+      BLOCK_LINKS(l->prev)->next = l->next;
+   }
+   else
+   {
+      freeList = l->next;
+   }
+
+#if defined NEXT && NEXT == 0
+   if (LAST_NF_VISITED == b)
+   {
+      LAST_NF_VISITED = l->next;
+   }
+#endif
+}
+
+/*
+ * \brief markFree
+ *
+ * Sets the free flag and footer of b and tells its physical successor.
+ *
+ * \param b the _block to mark
+ *
+ * \return none
+ */
+static void markFree(struct _block *b)
+{
+   b->size |= BLOCK_FREE;
+   *BLOCK_FOOTER(b) = BLOCK_SIZE(b);
+   BLOCK_NEXT(b)->size |= BLOCK_PREV_FREE;
+}
+
 /*
  * \brief findFreeBlock
  *
- * \param last pointer to the linked list of free _blocks
+ * Only free _blocks are on the list, so every candidate visited is one
+ * that could be used.
+ *
  * \param size size of the _block needed in bytes 
  *
  * \return a _block that fits the request or NULL if no free _block matches
  *
  */
-struct _block *findFreeBlock(struct _block **last, size_t size) 
+struct _block *findFreeBlock(size_t size) 
 {
    struct _block *curr = freeList;
 #if defined FIT && FIT == 0
    /* First fit */
-   while (curr && !(curr->free && curr->size >= size)) 
+   while (curr && BLOCK_SIZE(curr) < size) 
    {
-      *last = curr;
-      curr  = curr->next;
+      curr  = BLOCK_LINKS(curr)->next;
    }
 #endif
 
@@ -92,21 +559,22 @@ struct _block *findFreeBlock(struct _block **last, size_t size)
    struct _block * best = NULL;
    while (curr != NULL) {
       
-      bool can_store_block = (curr->free) && (curr->size >= (size + sizeof(struct _block *)));
-      bool is_way_better = (best == NULL) || (curr->size < best->size);
+      size_t curr_size = BLOCK_SIZE(curr);
+      bool can_store_block = curr_size >= size;
+      bool is_way_better = (best == NULL) || (curr_size < BLOCK_SIZE(best));
 
       if (can_store_block && is_way_better) {
 
          best = curr;
 
          /* optimal case where we have a perfect fitting block, we can exit early */
-         if (best->size == size + sizeof(struct _block *)) {
+         if (curr_size == size) {
             break;
          }
 
       }
 
-      curr = curr->next;
+      curr = BLOCK_LINKS(curr)->next;
    }
 
    curr = best;
@@ -119,14 +587,15 @@ struct _block *findFreeBlock(struct _block **last, size_t size)
 
    /* Traverse the LL, if we find a new min, redefine "best" to the current iteration */
    while (curr != NULL) {
-      bool can_store_block = (curr->free) && (curr->size >= size);
-      bool is_so_much_worse = (worst == NULL) || (curr->size > worst->size);
+      size_t curr_size = BLOCK_SIZE(curr);
+      bool can_store_block = curr_size >= size;
+      bool is_so_much_worse = (worst == NULL) || (curr_size > BLOCK_SIZE(worst));
 
       if (can_store_block && is_so_much_worse) {
          worst = curr;
       }
 
-      curr = curr->next;
+      curr = BLOCK_LINKS(curr)->next;
    }
 
    curr = worst;
@@ -135,17 +604,28 @@ struct _block *findFreeBlock(struct _block **last, size_t size)
 #if defined NEXT && NEXT == 0
    /* Next fit */
    /* Next fit picks up where we last left off, so we have a global that tracks the last exit block
-      and start from there. It's no different from FF */
+      and start from there, wrapping around to the head of the list once. */
+
+   struct _block *start = LAST_NF_VISITED ? LAST_NF_VISITED : freeList;
 
-   if (LAST_NF_VISITED != NULL) {
-      curr = LAST_NF_VISITED;
+   curr = start;
+   while (curr && BLOCK_SIZE(curr) < size) 
+   {
+      curr = BLOCK_LINKS(curr)->next;
    }
 
-   /* do FF */ 
-   while (curr && !(curr->free && curr->size >= size)) 
+   if (curr == NULL)
    {
-      *last = curr;
-      curr  = curr->next;
+      curr = freeList;
+      while (curr != start && BLOCK_SIZE(curr) < size)
+      {
+         curr = BLOCK_LINKS(curr)->next;
+      }
+
+      if (curr == start)
+      {
+         curr = NULL;
+      }
    }
 
    LAST_NF_VISITED = curr;
@@ -159,129 +639,269 @@ struct _block *findFreeBlock(struct _block **last, size_t size)
  * \brief growheap
  *
  * Given a requested size of memory, use sbrk() to dynamically 
- * increase the data segment of the calling process.  Updates
- * the free list with the newly allocated memory.
+ * increase the data segment of the calling process.  If the break
+ * has not moved since the last call the new _block takes over the old
+ * epilogue and stays physically adjacent to the rest of the heap,
+ * otherwise a new segment is started.
  *
- * \param last tail of the free _block list
  * \param size size in bytes to request from the OS
  *
  * \return returns the newly allocated _block of NULL if failed
  */
-struct _block *growHeap(struct _block *last, size_t size) 
+struct _block *growHeap(size_t size) 
 {
-   /* Request more space from OS */
-   struct _block *curr = (struct _block *)sbrk(0);
-   struct _block *prev = (struct _block *)sbrk(sizeof(struct _block) + size);
+   struct _block *curr;
+   size_t         need;
+   size_t         flags = 0;
 
-   assert(curr == prev);
-
-   /* OS allocation failed */
-   if (curr == (struct _block *)-1) 
+   if (size > (size_t)INTPTR_MAX - 2 * sizeof(struct _block))
    {
       return NULL;
    }
 
-   /* Update freeList if not set */
-   if (freeList == NULL) 
+   /* Request more space from OS */
+   curr = (struct _block *)sbrk(0);
+
+   if (heapEnd != NULL && curr == BLOCK_DATA(heapEnd))
    {
-      freeList = curr;
+      /* Contiguous with the previous segment, reuse its epilogue */
+      need  = size;
+      curr  = heapEnd;
+      flags = heapEnd->size & BLOCK_PREV_FREE;
    }
+   else
+   {
+      /* Keep the first header word aligned */
+      size_t pad = (ALIGN_WORD((uintptr_t)curr) - (uintptr_t)curr);
+
+      need = pad + sizeof(struct _block) + size;
+      curr = (struct _block *)((char *)curr + pad);
+   }
+
+   /* The new epilogue */
+   need += sizeof(struct _block);
 
-   /* Attach new _block to prev _block */
-   if (last) 
+   /* OS allocation failed */
+   if (sbrk(need) == (void *)-1) 
    {
-      last->next = curr;
+      return NULL;
    }
 
-   /* Update _block metadata */
-   curr->size = size;
-   curr->next = NULL;
-   curr->free = false;
+   /* Update _block metadata, keeping BLOCK_PREV_FREE from the old epilogue */
+   curr->size = size | flags;
+
+   heapEnd = BLOCK_NEXT(curr);
+   heapEnd->size = 0;
 
    num_requested++;
    return curr;
 }
 
 /*
- * \brief malloc
+ * Locking
  *
- * finds a free _block of heap memory for the calling process.
- * if there is no free _block that satisfies the request then grows the 
- * heap and returns a new _block
+ * A single mutex protects the free list, the heap segments and the
+ * statistics.  Across fork() the prepare handler takes the lock so no
+ * other thread can be half way through a free list update when the
+ * address space is copied; the parent then simply unlocks, while the
+ * child, whose other threads are gone, re-initialises the mutex rather
+ * than trusting its inherited state.
+ */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void forkPrepare(void)
+{
+   pthread_mutex_lock(&heap_lock);
+}
+
+static void forkParent(void)
+{
+   pthread_mutex_unlock(&heap_lock);
+}
+
+static void forkChild(void)
+{
+   pthread_mutex_init(&heap_lock, NULL);
+}
+
+/*
+ * \brief heapAbort
+ *
+ * Reports a misuse of the heap found with the heap lock held and aborts.
+ * assert() and stdio would call malloc() and wait on the lock forever, so
+ * the lock is released and the message goes straight to write().
+ *
+ * \param msg the message, ending in a newline
+ *
+ * \return never
+ */
+static void heapAbort(const char *msg)
+{
+   pthread_mutex_unlock(&heap_lock);
+   if (write(STDERR_FILENO, msg, strlen(msg)) < 0)
+   {
+      /* nothing left to report it with */
+   }
+   abort();
+}
+
+/*
+ * Bootstrap arena
+ *
+ * Allocations made while the allocator is initialising itself, or while
+ * printStatistics() runs, are bump allocated from a static arena.  Those
+ * calls come from atexit(), pthread_atfork() and stdio re-entering
+ * malloc(), and when the library is preloaded they can happen before
+ * anything else in the process is set up.  Bootstrap blocks carry a
+ * normal header so realloc() can size them, and free() ignores them.
+ * Once the arena is full requests fall through to the heap.  Only the
+ * thread initialising or printing the statistics uses the arena, other
+ * threads wait for the initialisation to finish.
+ */
+#define BOOTSTRAP_SIZE     (64 * 1024)
+#define BOOTSTRAP_ALIGN    16
+
+static char   bootstrap_arena[BOOTSTRAP_SIZE] __attribute__((aligned(BOOTSTRAP_ALIGN)));
+static size_t bootstrap_used = 0;
+
+#define IS_BOOTSTRAP(ptr)  ((char *)(ptr) >= bootstrap_arena && \
+                            (char *)(ptr) <  bootstrap_arena + BOOTSTRAP_SIZE)
+
+/*
+ * \brief bootstrapAlloc
  *
  * \param size size of the requested memory in bytes
  *
- * \return returns the requested memory allocation to the calling process 
- * or NULL if failed
+ * \return memory from the bootstrap arena or NULL if it is exhausted
  */
-void *malloc(size_t size) 
+static void *bootstrapAlloc(size_t size)
 {
+   size_t payload, need, used;
 
-   if( atexit_registered == 0 )
+   if (size == 0 || size > BOOTSTRAP_SIZE)
    {
-      atexit_registered = 1;
-      atexit( printStatistics );
+      return NULL;
    }
 
-   /* Align to multiple of 4 */
-   size = ALIGN4(size);
+   /* the header goes in the alignment word in front of the payload */
+   payload = (size + BOOTSTRAP_ALIGN - 1) & ~(size_t)(BOOTSTRAP_ALIGN - 1);
+   need = payload + BOOTSTRAP_ALIGN;
+
+   /* need ends exactly at the end of the payload */
+   used = __atomic_fetch_add(&bootstrap_used, need, __ATOMIC_RELAXED);
+   if (used + need > BOOTSTRAP_SIZE)
+   {
+      return NULL;
+   }
+
+   /* header in the last word before the aligned payload */
+   struct _block *b = (struct _block *)(bootstrap_arena + used + BOOTSTRAP_ALIGN) - 1;
+   b->size = payload;
+
+   return BLOCK_DATA(b);
+}
+
+/*
+ * \brief heapInit
+ *
+ * One time set up on the first malloc(): the statistics handler, the fork
+ * handlers and the size classes.  Run once through pthread_once(), without
+ * the heap lock held and with the bootstrap arena serving any malloc()
+ * that atexit() or pthread_atfork() make themselves on this thread.
+ *
+ * \return none
+ */
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+
+static void heapInit(void)
+{
+   bootstrapping++;
+
+   atexit( printStatistics );
+   pthread_atfork( forkPrepare, forkParent, forkChild );
+   sizeClassInit();
 
+   bootstrapping--;
+}
+
+/*
+ * \brief heapAlloc
+ *
+ * finds a free _block of heap memory for the calling process.
+ * if there is no free _block that satisfies the request then grows the 
+ * heap and returns a new _block.  Called with the heap lock held.
+ *
+ * \param size size of the requested memory in bytes
+ *
+ * \return returns the requested memory allocation or NULL if failed
+ */
+static void *heapAlloc(size_t size) 
+{
    /* Handle 0 size */
    if (size == 0) 
    {
       return NULL;
    }
 
+   /* Align to the header word, blocks have to be able to hold the
+      free list links once freed */
+   size = ALIGN_WORD(size);
+   if (size < MIN_PAYLOAD)
+   {
+      size = MIN_PAYLOAD;
+   }
+
+   /* Round up to the tuned size class, if any; classes are block sizes */
+   size = sizeClassRound(size);
+
    /* Look for free _block */
-   struct _block *last = freeList;
-   struct _block *next = findFreeBlock(&last, size);
-
-   /* If a free block is larger than the requested size then split the block into two. */ 
-   if (next != NULL && next->size > size) {
-
-      /* make a new block of size next->size - size, the amount of extra unused space */
-      struct _block * new = (struct _block *)sbrk(sizeof(struct _block) + (next->size - size));
-      new->size = next->size - size;
-      new->free = true;
-
-      /* if next has no subsequent block, then new has no subsequent block */
-      /* if next has a subsequent block, that block belongs to new now */
-      if (next->next == NULL) {
-         new->next = NULL;
-      } else {
-         new->next = next->next;
-      }
+   struct _block *next = findFreeBlock(size);
 
-      /* next's subsequent block is now new */
-      next->next = new;
+   if (next != NULL)
+   {
+      /* If a free block is larger than the requested size then split the block into two. */ 
+      if (BLOCK_SIZE(next) >= size + sizeof(struct _block) + MIN_PAYLOAD)
+      {
+         struct _block *rest = (struct _block *)((char *)BLOCK_DATA(next) + size);
 
-      num_blocks++;
-      num_grows++;
-      num_splits++;
-      num_requested++;
-   }
+         /* the remainder keeps next's place on the free list */
+         rest->size = BLOCK_SIZE(next) - size - sizeof(struct _block);
+         freeListReplace(next, rest);
+         markFree(rest);
+
+         next->size = size | (next->size & BLOCK_PREV_FREE);
 
-   /* Could not find free _block, so grow heap */
-   if (next == NULL) 
+         num_blocks++;
+         num_splits++;
+      }
+      else
+      {
+         freeListRemove(next);
+         BLOCK_NEXT(next)->size &= ~BLOCK_PREV_FREE;
+      }
+
+      /* a free block was found and can be repurposed */
+      num_reuses++;
+   }
+   else
    {
-      next = growHeap(last, size);
+      /* Could not find free _block, so grow heap */
+      next = growHeap(size);
+
+      /* Could not find free _block or grow heap, so just return NULL */
+      if (next == NULL) 
+      {
+         return NULL;
+      }
+
       num_blocks++;
       num_grows++;
 
       max_heap += size;
-   } else {
-      /* a free block was found and can be repurposed */
-      num_reuses++;
    }
 
-   /* Could not find free _block or grow heap, so just return NULL */
-   if (next == NULL) 
-   {
-      return NULL;
-   }
-   
    /* Mark _block as in use */
-   next->free = false;
+   next->size &= ~BLOCK_FREE;
    
    /* it worked */
    num_mallocs++;
@@ -290,66 +910,375 @@ void *malloc(size_t size)
    return BLOCK_DATA(next);
 }
 
-/* The way realloc works is by deallocating the old pointer, and reallocating a new one at a new size. */
+/*
+ * \brief malloc
+ *
+ * \param size size of the requested memory in bytes
+ *
+ * \return returns the requested memory allocation to the calling process 
+ * or NULL if failed
+ */
+void *malloc(size_t size) 
+{
+   void *ptr;
+
+   /* refused before any rounding can wrap it to a small size */
+   if (size > MAX_PAYLOAD)
+   {
+      errno = ENOMEM;
+      return NULL;
+   }
+
+   /* checked first: a malloc() from inside heapInit() must not wait on itself */
+   if( bootstrapping )
+   {
+      ptr = bootstrapAlloc(size);
+      if (ptr != NULL)
+      {
+         return ptr;
+      }
+   }
+   else
+   {
+      pthread_once( &heap_once, heapInit );
+   }
+
+   pthread_mutex_lock(&heap_lock);
+   ptr = heapAlloc(size);
+   pthread_mutex_unlock(&heap_lock);
+
+   return ptr;
+}
+
+/* Grows by allocating a new block and copying the old payload over; shrinking and
+   growth that still fits the current block are done in place. */
 void * realloc(void * old, size_t s) {
-   struct _block * new = malloc(s);
-   memcpy(new, old, s);
+   if (old == NULL) {
+      return malloc(s);
+   }
+
+   if (s == 0) {
+      free(old);
+      return NULL;
+   }
+
+   /* the old block stays valid, as for any failed realloc() */
+   if (s > MAX_PAYLOAD) {
+      errno = ENOMEM;
+      return NULL;
+   }
+
+   size_t old_size = BLOCK_SIZE(BLOCK_HEADER(old));
+   if (old_size >= s) {
+      return old;
+   }
+
+   void * new = malloc(s);
+   if (new == NULL) {
+      return NULL;
+   }
+
+   memcpy(new, old, old_size);
    free(old);
 
    return new;
 }
 
 void* calloc(size_t num, size_t size_of_element) {
-   struct _block * ptr = malloc(num * size_of_element);
-   memset(ptr, 0, num * size_of_element);
+   if (size_of_element != 0 && num > SIZE_MAX / size_of_element) {
+      errno = ENOMEM;
+      return NULL;
+   }
+
+   void * ptr = malloc(num * size_of_element);
+   if (ptr != NULL) {
+      memset(ptr, 0, num * size_of_element);
+   }
    return ptr;
 }
 
 /*
- * \brief free
+ * \brief heapFree
  *
  * frees the memory _block pointed to by pointer. if the _block is adjacent
- * to another _block then coalesces (combines) them
+ * to another _block then coalesces (combines) them.  Called with the heap
+ * lock held; nothing here may call assert() or anything else that could
+ * allocate.
  *
  * \param ptr the heap memory to free
  *
  * \return none
  */
-void free(void *ptr) 
+static void heapFree(void *ptr) 
 {
-   if (ptr == NULL) 
+   /* Make _block as free */
+   struct _block *curr = BLOCK_HEADER(ptr);
+   struct _block *next = BLOCK_NEXT(curr);
+   if (BLOCK_IS_FREE(curr))
    {
-      return;
+      heapAbort("free(): double free or corrupted block\n");
    }
 
-   /* Make _block as free */
-   struct _block *curr = BLOCK_HEADER(ptr);
-   assert(curr->free == 0);
-   curr->free = true;
+   bool listed = false;
    
-   /* Coalesce two adjacent blocks */
-
-   curr = freeList;
-   /* traverse the LL
-      if the current block is free, and the next one is free
-      mash them together by setting the next block to the current one iteratively.
-    */
-   while (curr) {
-      if ((curr && curr->next) && (curr->free && curr->next->free)) {
-
-         curr->size = curr->next->size;
-         curr->next = curr->next->next;
-
-         /* when we coalesces, we reduce number of block allocated */
-         num_coalesces++;
-         num_blocks--;
+   /* Coalesce with the physical successor, taking its place on the free list */
+   if (BLOCK_IS_FREE(next))
+   {
+      freeListReplace(next, curr);
+      curr->size += sizeof(struct _block) + BLOCK_SIZE(next);
+      listed = true;
+
+      /* when we coalesces, we reduce number of block allocated */
+      num_coalesces++;
+      num_blocks--;
+   }
+
+   /* Coalesce with the physical predecessor, which is already on the free list */
+   if (curr->size & BLOCK_PREV_FREE)
+   {
+      struct _block *prev = BLOCK_PREV(curr);
+
+      if (listed)
+      {
+         freeListRemove(curr);
       }
-      curr = curr->next;
+
+      prev->size += sizeof(struct _block) + BLOCK_SIZE(curr);
+      curr = prev;
+      listed = true;
+
+      num_coalesces++;
+      num_blocks--;
+   }
+
+   if (!listed)
+   {
+      freeListInsert(curr);
    }
 
+   markFree(curr);
+
    num_frees++;
 
 }
 
+/*
+ * \brief free
+ *
+ * \param ptr the heap memory to free
+ *
+ * \return none
+ */
+void free(void *ptr) 
+{
+   /* Bootstrap memory is never reused */
+   if (ptr == NULL || IS_BOOTSTRAP(ptr)) 
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&heap_lock);
+   heapFree(ptr);
+   pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * Aligned allocation
+ *
+ * Payloads are only word aligned.  A stricter alignment is carved out of
+ * a larger block: the aligned address gets a header of its own, the
+ * bytes in front of it become a free block, and so does any tail the
+ * request doesn't need.  The gap in front is made big enough to hold a
+ * free block, so every piece stays a valid _block that free(), realloc()
+ * and coalescing handle like any other.
+ */
+
+/*
+ * \brief heapAlignedAlloc
+ *
+ * \param alignment a power of two
+ * \param size      size of the requested memory in bytes
+ *
+ * Called with the heap lock held.
+ *
+ * \return memory aligned to alignment or NULL if failed
+ */
+static void *heapAlignedAlloc(size_t alignment, size_t size)
+{
+   const size_t   piece = sizeof(struct _block) + MIN_PAYLOAD;
+   struct _block *b, *rest;
+   char          *data, *aligned;
+   size_t         gap;
+
+   if (alignment <= sizeof(struct _block))
+   {
+      return heapAlloc(size);
+   }
+
+   data = heapAlloc(size + alignment + piece);
+   if (data == NULL)
+   {
+      return NULL;
+   }
+
+   aligned = (char *)(((uintptr_t)data + alignment - 1) & ~(uintptr_t)(alignment - 1));
+   while (aligned != data && (size_t)(aligned - data) < piece)
+   {
+      aligned += alignment;
+   }
+
+   b   = BLOCK_HEADER(data);
+   gap = aligned - data;
+
+   if (gap > 0)
+   {
+      /* the front becomes a block of its own and is freed */
+      struct _block *front = b;
+
+      b = BLOCK_HEADER(aligned);
+      b->size  = BLOCK_SIZE(front) - gap;
+      front->size = (gap - sizeof(struct _block)) | (front->size & BLOCK_PREV_FREE);
+
+      num_blocks++;
+      num_splits++;
+      heapFree(BLOCK_DATA(front));
+      num_frees--;
+   }
+
+   /* give back the tail as well, as heapAlloc() does when splitting */
+   size = ALIGN_WORD(size);
+   if (size < MIN_PAYLOAD)
+   {
+      size = MIN_PAYLOAD;
+   }
+
+   if (BLOCK_SIZE(b) >= size + piece)
+   {
+      rest = (struct _block *)((char *)BLOCK_DATA(b) + size);
+      rest->size = BLOCK_SIZE(b) - size - sizeof(struct _block);
+      b->size = size | (b->size & BLOCK_PREV_FREE);
+
+      num_blocks++;
+      num_splits++;
+      heapFree(BLOCK_DATA(rest));
+      num_frees--;
+   }
+
+   return BLOCK_DATA(b);
+}
+
+/*
+ * \brief alignedAlloc
+ *
+ * The common part of the aligned allocation calls.
+ *
+ * \param alignment a power of two
+ * \param size      size of the requested memory in bytes
+ *
+ * \return memory aligned to alignment or NULL with errno set
+ */
+static void *alignedAlloc(size_t alignment, size_t size)
+{
+   void *ptr;
+
+   if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+   {
+      errno = EINVAL;
+      return NULL;
+   }
+
+   if (size == 0)
+   {
+      return NULL;
+   }
+
+   if (alignment > MAX_PAYLOAD / 2 || size > MAX_PAYLOAD - alignment - sizeof(struct _block) - MIN_PAYLOAD)
+   {
+      errno = ENOMEM;
+      return NULL;
+   }
+
+   if( bootstrapping )
+   {
+      if (alignment <= BOOTSTRAP_ALIGN && (ptr = bootstrapAlloc(size)) != NULL)
+      {
+         return ptr;
+      }
+   }
+   else
+   {
+      pthread_once( &heap_once, heapInit );
+   }
+
+   pthread_mutex_lock(&heap_lock);
+   ptr = heapAlignedAlloc(alignment, size);
+   pthread_mutex_unlock(&heap_lock);
+
+   return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+   return alignedAlloc(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+   return alignedAlloc(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+   void *ptr;
+   int   saved = errno;
+
+   if (alignment % sizeof(void *) != 0)
+   {
+      return EINVAL;
+   }
+
+   ptr = alignedAlloc(alignment, size);
+   if (ptr == NULL && size != 0)
+   {
+      int error = errno;
+      errno = saved;
+      return error == EINVAL ? EINVAL : ENOMEM;
+   }
+
+   errno = saved;
+   *memptr = ptr;
+   return 0;
+}
+
+void *valloc(size_t size)
+{
+   return alignedAlloc(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size)
+{
+   size_t page = sysconf(_SC_PAGESIZE);
+
+   if (size > MAX_PAYLOAD)
+   {
+      errno = ENOMEM;
+      return NULL;
+   }
+
+   return alignedAlloc(page, (size + page - 1) & ~(page - 1));
+}
+
+/*
+ * \brief malloc_usable_size
+ *
+ * \param ptr memory from any of the allocation calls
+ *
+ * \return the payload size of its _block, 0 for NULL
+ */
+size_t malloc_usable_size(void *ptr)
+{
+   return ptr ? BLOCK_SIZE(BLOCK_HEADER(ptr)) : 0;
+}
+
 /* vim: set expandtab sts=3 sw=3 ts=6 ft=cpp: --------------------------------*/
 
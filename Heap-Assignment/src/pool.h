@@ -0,0 +1,95 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdlib.h>
+
+/*
+ * Fixed size object pools
+ *
+ * POOL_DEFINE(name, type) generates a free list allocator for objects of
+ * one type:
+ *
+ *    type *name_pool_alloc( void );
+ *    void  name_pool_free( type *ptr );
+ *
+ * The slot size is sizeof(type) (or a pointer, whichever is larger) and
+ * known at compile time, so both calls inline to a load and a store on
+ * the free list head.  Only an empty list falls back to malloc(), which
+ * hands over POOL_CHUNK_OBJECTS slots at once.  Chunks are never given
+ * back, freed objects stay in the pool for reuse.
+ *
+ * POOL_DEFINE gives one pool for the whole process which the caller has
+ * to serialise.  POOL_DEFINE_PER_THREAD gives every thread its own free
+ * list, needing no locking; an object freed by another thread than the
+ * one that allocated it just joins the freeing thread's list, and the
+ * slots on a thread's list are leaked when the thread exits.
+ *
+ * The header stands alone: it is for programs running on top of the
+ * allocator, which doesn't use it itself since refilling calls malloc().
+ * tests/test6.c shows the intended use.
+ */
+
+#ifndef POOL_CHUNK_OBJECTS
+#define POOL_CHUNK_OBJECTS 256
+#endif
+
+#define POOL_DEFINE(name, type)             POOL_DEFINE_STORAGE(name, type, )
+#define POOL_DEFINE_PER_THREAD(name, type)  POOL_DEFINE_STORAGE(name, type, __thread)
+
+#define POOL_DEFINE_STORAGE(name, type, storage)                           \
+                                                                           \
+union name##_pool_slot                                                     \
+{                                                                          \
+   type                       object;                                      \
+   union name##_pool_slot    *next;                                        \
+};                                                                         \
+                                                                           \
+static storage union name##_pool_slot *name##_pool_head = NULL;            \
+                                                                           \
+static __attribute__((noinline, unused)) int name##_pool_refill( void )    \
+{                                                                          \
+   union name##_pool_slot *chunk;                                          \
+   int i;                                                                  \
+                                                                           \
+   chunk = malloc( POOL_CHUNK_OBJECTS * sizeof(union name##_pool_slot) );  \
+   if ( chunk == NULL )                                                    \
+   {                                                                       \
+      return 0;                                                            \
+   }                                                                       \
+                                                                           \
+   for ( i = 0; i < POOL_CHUNK_OBJECTS - 1; i++ )                          \
+   {                                                                       \
+      chunk[i].next = &chunk[i + 1];                                       \
+   }                                                                       \
+   chunk[POOL_CHUNK_OBJECTS - 1].next = name##_pool_head;                  \
+   name##_pool_head = chunk;                                               \
+                                                                           \
+   return 1;                                                               \
+}                                                                          \
+                                                                           \
+static inline __attribute__((unused)) type *name##_pool_alloc( void )      \
+{                                                                          \
+   union name##_pool_slot *slot = name##_pool_head;                        \
+                                                                           \
+   if ( __builtin_expect( slot == NULL, 0 ) )                              \
+   {                                                                       \
+      if ( !name##_pool_refill() )                                         \
+      {                                                                    \
+         return NULL;                                                      \
+      }                                                                    \
+      slot = name##_pool_head;                                             \
+   }                                                                       \
+                                                                           \
+   name##_pool_head = slot->next;                                          \
+   return &slot->object;                                                   \
+}                                                                          \
+                                                                           \
+static inline __attribute__((unused)) void name##_pool_free( type *ptr )   \
+{                                                                          \
+   union name##_pool_slot *slot = (union name##_pool_slot *)ptr;           \
+                                                                           \
+   slot->next = name##_pool_head;                                          \
+   name##_pool_head = slot;                                                \
+}
+
+#endif
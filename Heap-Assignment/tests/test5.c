@@ -0,0 +1,49 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static void * churn( void * arg )
+{
+  int i;
+  for ( i = 0; i < 100000; i++ )
+  {
+    char * ptr = ( char * ) malloc ( 16 + i % 512 );
+    free( ptr );
+  }
+
+  return arg;
+}
+
+int main()
+{
+  printf("Running test 5 to test fork while other threads allocate\n");
+
+  pthread_t tid[4];
+  int i;
+  for ( i = 0; i < 4; i++ )
+  {
+    pthread_create( &tid[i], NULL, churn, NULL );
+  }
+
+  for ( i = 0; i < 64; i++ )
+  {
+    pid_t pid = fork();
+    if ( pid == 0 )
+    {
+      /* would deadlock here if the heap lock was copied while held */
+      char * ptr = ( char * ) malloc ( 1024 );
+      free( ptr );
+      _exit( 0 );
+    }
+    waitpid( pid, NULL, 0 );
+  }
+
+  for ( i = 0; i < 4; i++ )
+  {
+    pthread_join( tid[i], NULL );
+  }
+
+  return 0;
+}
@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "../src/pool.h"
+
+struct entry
+{
+  char name[12];
+  int  start;
+  int  size;
+};
+
+POOL_DEFINE( entry, struct entry )
+POOL_DEFINE_PER_THREAD( local_entry, struct entry )
+
+static void * churn( void * arg )
+{
+  struct entry * ptr_array[512];
+  int i, j;
+
+  for ( j = 0; j < 1000; j++ )
+  {
+    for ( i = 0; i < 512; i++ )
+    {
+      ptr_array[i] = local_entry_pool_alloc();
+      ptr_array[i]->start = i;
+    }
+
+    for ( i = 0; i < 512; i++ )
+    {
+      if ( ptr_array[i]->start != i )
+      {
+        printf("Pool object %d was overwritten\n", i );
+        exit( 1 );
+      }
+      local_entry_pool_free( ptr_array[i] );
+    }
+  }
+
+  return arg;
+}
+
+int main()
+{
+  printf("Running test 6 to test fixed size object pools\n");
+
+  struct entry * ptr1 = entry_pool_alloc();
+  entry_pool_free( ptr1 );
+
+  struct entry * ptr2 = entry_pool_alloc();
+  if ( ptr1 != ptr2 )
+  {
+    printf("Freed pool object was not reused\n");
+    return 1;
+  }
+  entry_pool_free( ptr2 );
+
+  pthread_t tid[4];
+  int i;
+  for ( i = 0; i < 4; i++ )
+  {
+    pthread_create( &tid[i], NULL, churn, NULL );
+  }
+
+  for ( i = 0; i < 4; i++ )
+  {
+    pthread_join( tid[i], NULL );
+  }
+
+  return 0;
+}
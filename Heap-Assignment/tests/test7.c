@@ -0,0 +1,39 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+int main()
+{
+  printf("Running test 7 to test requests too large to round up\n");
+
+  /* volatile so the compiler doesn't warn about the sizes */
+  volatile size_t huge = SIZE_MAX - 5;
+  volatile size_t half = SIZE_MAX / 2 + 1;
+
+  /* these used to wrap around to a tiny block */
+  char * ptr = ( char * ) malloc ( huge );
+  if ( ptr != NULL || errno != ENOMEM )
+  {
+    printf("malloc(SIZE_MAX - 5) did not fail with ENOMEM\n");
+    return 1;
+  }
+
+  if ( calloc ( 2, half ) != NULL || calloc ( 1, huge ) != NULL )
+  {
+    printf("an overflowing calloc() succeeded\n");
+    return 1;
+  }
+
+  ptr = ( char * ) malloc ( 64 );
+  strcpy( ptr, "still here" );
+  if ( realloc ( ptr, huge ) != NULL || strcmp( ptr, "still here" ) != 0 )
+  {
+    printf("realloc(SIZE_MAX - 5) did not fail and keep the old block\n");
+    return 1;
+  }
+  free( ptr );
+
+  return 0;
+}
@@ -0,0 +1,59 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <malloc.h>
+
+static int check( void * ptr, size_t alignment, size_t size )
+{
+  if ( ptr == NULL || ( uintptr_t ) ptr % alignment != 0 || malloc_usable_size( ptr ) < size )
+  {
+    printf("bad block %p for alignment %zu size %zu\n", ptr, alignment, size );
+    return 0;
+  }
+
+  memset( ptr, 0xa5, size );
+  return 1;
+}
+
+int main()
+{
+  printf("Running test 8 to test aligned allocation\n");
+
+  void * ptrs[64];
+  size_t alignment;
+  int i;
+
+  /* the blocks around aligned ones must survive being freed in any order */
+  for ( i = 0, alignment = 16; alignment <= 8192; alignment *= 2, i++ )
+  {
+    ptrs[2*i] = aligned_alloc( alignment, 100 + i * 300 );
+    if ( !check( ptrs[2*i], alignment, 100 + i * 300 ) ) return 1;
+    ptrs[2*i+1] = malloc( 40 );
+  }
+  for ( ; i > 0; i-- )
+  {
+    free( ptrs[2*(i-1)] );
+    free( ptrs[2*(i-1)+1] );
+  }
+
+  void * ptr;
+  if ( posix_memalign( &ptr, 64, 256 ) != 0 || !check( ptr, 64, 256 ) ) return 1;
+  free( ptr );
+  if ( posix_memalign( &ptr, 24, 256 ) == 0 ) return 1;
+
+  ptr = memalign( 128, 1000 );
+  if ( !check( ptr, 128, 1000 ) ) return 1;
+
+  /* realloc of an aligned block keeps its data */
+  char * grown = ( char * ) realloc( ptr, 100000 );
+  if ( grown == NULL || ( unsigned char ) grown[999] != 0xa5 ) return 1;
+  free( grown );
+
+  ptr = valloc( 5000 );
+  if ( !check( ptr, 4096, 5000 ) ) return 1;
+  free( ptr );
+
+  return 0;
+}